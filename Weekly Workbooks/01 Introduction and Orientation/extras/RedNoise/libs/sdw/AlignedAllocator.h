@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+// Allocator for std::vector that hands out storage aligned to `Alignment` bytes (a power of two, at least
+// sizeof(void *)), so that buffers can be read and written with aligned SIMD loads and stores.
+template<typename T, size_t Alignment = 64>
+struct AlignedAllocator {
+	typedef T value_type;
+
+	template<typename U>
+	struct rebind {
+		typedef AlignedAllocator<U, Alignment> other;
+	};
+
+	AlignedAllocator() = default;
+	template<typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+	T *allocate(size_t n) {
+		if (n == 0) return nullptr;
+		void *memory = nullptr;
+#if defined(_MSC_VER)
+		memory = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+		if (posix_memalign(&memory, Alignment, n * sizeof(T)) != 0) memory = nullptr;
+#endif
+		if (memory == nullptr) throw std::bad_alloc();
+		return static_cast<T *>(memory);
+	}
+
+	void deallocate(T *memory, size_t) {
+#if defined(_MSC_VER)
+		_aligned_free(memory);
+#else
+		free(memory);
+#endif
+	}
+};
+
+template<typename T, typename U, size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &) { return true; }
+
+template<typename T, typename U, size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &) { return false; }
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Non-owning view of a contiguous array, for handing out data that may live in a std::vector or straight inside
+// a memory mapped file without copying it. Whoever owns the memory has to outlive the view.
+template<typename T>
+struct ArrayView {
+	const T *pointer = nullptr;
+	size_t count = 0;
+
+	ArrayView() = default;
+	ArrayView(const T *pointer, size_t count) : pointer(pointer), count(count) {}
+	template<typename Allocator>
+	ArrayView(const std::vector<T, Allocator> &vector) : pointer(vector.data()), count(vector.size()) {}
+
+	const T *data() const { return pointer; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const T &operator[](size_t index) const { return pointer[index]; }
+	const T *begin() const { return pointer; }
+	const T *end() const { return pointer + count; }
+};
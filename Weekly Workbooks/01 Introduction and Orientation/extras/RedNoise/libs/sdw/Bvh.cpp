@@ -0,0 +1,374 @@
+#include "Bvh.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include "ThreadPool.h"
+
+constexpr int Bvh::BIN_COUNT;
+constexpr size_t Bvh::MAX_DEPTH;
+
+namespace {
+
+// costs of visiting a node and of testing a triangle, relative to each other
+constexpr float TRAVERSAL_COST = 1.0f;
+constexpr float INTERSECTION_COST = 1.0f;
+// below this depth every split is a median split, which halves the triangle count each time, so the tree can't
+// get deeper than Bvh::MAX_DEPTH however the SAH splits above it went
+constexpr size_t MEDIAN_SPLIT_DEPTH = Bvh::MAX_DEPTH - 32;
+// Nodes with at least this many triangles find their bounds and bin them in parallel, BINNING_CHUNK_TRIANGLES per
+// task. Below that, and for subtrees smaller than SUBTREE_TASK_TRIANGLES, a task costs more than it saves.
+constexpr uint32_t PARALLEL_BINNING_TRIANGLES = 1 << 16;
+constexpr uint32_t BINNING_CHUNK_TRIANGLES = 1 << 14;
+constexpr uint32_t SUBTREE_TASK_TRIANGLES = 1 << 12;
+// per parallelFor index in the passes over every triangle
+constexpr size_t TRIANGLES_PER_CHUNK = 1 << 14;
+
+struct Bin {
+	Aabb bounds;
+	uint32_t count = 0;
+};
+
+typedef std::array<Bin, Bvh::BIN_COUNT> Bins;
+
+struct Split {
+	int axis = -1;
+	// triangles in bins [0, bin] go left
+	int bin = 0;
+	float cost = std::numeric_limits<float>::infinity();
+};
+
+class Builder {
+public:
+	// the first node (the root) is already taken
+	std::atomic<uint32_t> nodeCount{1};
+
+	Builder(const std::vector<Aabb> &triangleBounds, const std::vector<glm::vec3> &centroids, std::vector<uint32_t> &order, std::vector<BvhNode> &nodes, const BvhBuildOptions &options, TaskGroup *tasks) :
+			triangleBounds(triangleBounds), centroids(centroids), order(order), nodes(nodes), options(options), tasks(tasks) {}
+
+	// Every node is written by exactly one task and the node slots are handed out atomically, so subtrees can be
+	// built concurrently without any locking
+	void build(uint32_t nodeIndex, uint32_t begin, uint32_t end, size_t depth) {
+		Aabb bounds, centroidBounds;
+		findBounds(begin, end, bounds, centroidBounds);
+		nodes[nodeIndex].boundsMin = bounds.min;
+		nodes[nodeIndex].boundsMax = bounds.max;
+
+		uint32_t count = end - begin;
+		uint32_t middle = begin;
+		if (count > 1 && depth < MEDIAN_SPLIT_DEPTH) {
+			Split split = findSplit(begin, end, centroidBounds);
+			float leafCost = INTERSECTION_COST * testCount(count) * bounds.halfArea();
+			float splitCost = TRAVERSAL_COST * bounds.halfArea() + INTERSECTION_COST * split.cost;
+			if (split.axis >= 0 && (splitCost < leafCost || count > options.maxLeafTriangles)) {
+				middle = partition(begin, end, centroidBounds, split);
+			}
+		}
+		if (middle == begin && count > options.maxLeafTriangles) middle = medianSplit(begin, end, centroidBounds);
+
+		if (middle == begin) {
+			nodes[nodeIndex].offset = begin;
+			nodes[nodeIndex].triangleCount = count;
+			return;
+		}
+
+		uint32_t left = nodeCount.fetch_add(2, std::memory_order_relaxed);
+		nodes[nodeIndex].offset = left;
+		nodes[nodeIndex].triangleCount = 0;
+		if (tasks != nullptr && middle - begin >= SUBTREE_TASK_TRIANGLES && end - middle >= SUBTREE_TASK_TRIANGLES) {
+			tasks->run([this, left, begin, middle, depth] { build(left, begin, middle, depth + 1); });
+		} else {
+			build(left, begin, middle, depth + 1);
+		}
+		build(left + 1, middle, end, depth + 1);
+	}
+
+private:
+	const std::vector<Aabb> &triangleBounds;
+	const std::vector<glm::vec3> &centroids;
+	std::vector<uint32_t> &order;
+	std::vector<BvhNode> &nodes;
+	const BvhBuildOptions &options;
+	TaskGroup *tasks;
+
+	float testCount(uint32_t triangleCount) const {
+		return float((triangleCount + options.trianglesPerTest - 1) / options.trianglesPerTest);
+	}
+
+	static int binOf(float centroid, float axisMin, float binsPerUnit) {
+		return std::min(int((centroid - axisMin) * binsPerUnit), Bvh::BIN_COUNT - 1);
+	}
+
+	// Calls body(chunkBegin, chunkEnd, chunk) for each BINNING_CHUNK_TRIANGLES sized piece of a big range, as
+	// tasks of their own. Each chunk writes its own results, which the caller merges in chunk order, so the answer
+	// is exactly what a single pass would give.
+	template <typename Body>
+	void forEachBinningChunk(uint32_t begin, uint32_t end, const Body &body) const {
+		size_t chunkCount = (end - begin + BINNING_CHUNK_TRIANGLES - 1) / BINNING_CHUNK_TRIANGLES;
+		TaskGroup chunks(*options.pool);
+		for (size_t chunk = 0; chunk < chunkCount; chunk++) {
+			chunks.run([&, chunk] {
+				uint32_t chunkBegin = begin + uint32_t(chunk) * BINNING_CHUNK_TRIANGLES;
+				body(chunkBegin, std::min(end, chunkBegin + BINNING_CHUNK_TRIANGLES), chunk);
+			});
+		}
+		chunks.wait();
+	}
+
+	void findBounds(uint32_t begin, uint32_t end, Aabb &bounds, Aabb &centroidBounds) const {
+		auto pass = [&](uint32_t chunkBegin, uint32_t chunkEnd, Aabb &chunkBounds, Aabb &chunkCentroids) {
+			for (uint32_t i = chunkBegin; i < chunkEnd; i++) {
+				chunkBounds.grow(triangleBounds[order[i]]);
+				chunkCentroids.grow(centroids[order[i]]);
+			}
+		};
+		if (tasks == nullptr || end - begin < PARALLEL_BINNING_TRIANGLES) {
+			pass(begin, end, bounds, centroidBounds);
+			return;
+		}
+		std::vector<std::array<Aabb, 2>> chunkBounds((end - begin + BINNING_CHUNK_TRIANGLES - 1) / BINNING_CHUNK_TRIANGLES);
+		forEachBinningChunk(begin, end, [&](uint32_t chunkBegin, uint32_t chunkEnd, size_t chunk) {
+			pass(chunkBegin, chunkEnd, chunkBounds[chunk][0], chunkBounds[chunk][1]);
+		});
+		for (const auto &chunk : chunkBounds) {
+			bounds.grow(chunk[0]);
+			centroidBounds.grow(chunk[1]);
+		}
+	}
+
+	Bins binAxis(uint32_t begin, uint32_t end, int axis, float axisMin, float binsPerUnit) const {
+		auto pass = [&](uint32_t chunkBegin, uint32_t chunkEnd, Bins &bins) {
+			for (uint32_t i = chunkBegin; i < chunkEnd; i++) {
+				Bin &bin = bins[binOf(centroids[order[i]][axis], axisMin, binsPerUnit)];
+				bin.bounds.grow(triangleBounds[order[i]]);
+				bin.count++;
+			}
+		};
+		Bins bins;
+		if (tasks == nullptr || end - begin < PARALLEL_BINNING_TRIANGLES) {
+			pass(begin, end, bins);
+			return bins;
+		}
+		std::vector<Bins> chunkBins((end - begin + BINNING_CHUNK_TRIANGLES - 1) / BINNING_CHUNK_TRIANGLES);
+		forEachBinningChunk(begin, end, [&](uint32_t chunkBegin, uint32_t chunkEnd, size_t chunk) {
+			pass(chunkBegin, chunkEnd, chunkBins[chunk]);
+		});
+		for (const Bins &chunk : chunkBins) {
+			for (int bin = 0; bin < Bvh::BIN_COUNT; bin++) {
+				bins[bin].bounds.grow(chunk[bin].bounds);
+				bins[bin].count += chunk[bin].count;
+			}
+		}
+		return bins;
+	}
+
+	// Cheapest split between bins on any axis, by the sum of each side's area times the tests its triangles take
+	Split findSplit(uint32_t begin, uint32_t end, const Aabb &centroidBounds) const {
+		Split best;
+		for (int axis = 0; axis < 3; axis++) {
+			float axisMin = centroidBounds.min[axis];
+			float extent = centroidBounds.max[axis] - axisMin;
+			if (!(extent > 0)) continue;
+			Bins bins = binAxis(begin, end, axis, axisMin, Bvh::BIN_COUNT / extent);
+
+			// sweep from the right first, so the left sweep can price each split as it goes
+			float rightCosts[Bvh::BIN_COUNT];
+			Aabb right;
+			uint32_t rightCount = 0;
+			for (int bin = Bvh::BIN_COUNT - 1; bin > 0; bin--) {
+				right.grow(bins[bin].bounds);
+				rightCount += bins[bin].count;
+				rightCosts[bin] = rightCount == 0 ? 0 : right.halfArea() * testCount(rightCount);
+			}
+			Aabb left;
+			uint32_t leftCount = 0;
+			for (int bin = 0; bin < Bvh::BIN_COUNT - 1; bin++) {
+				left.grow(bins[bin].bounds);
+				leftCount += bins[bin].count;
+				uint32_t remaining = (end - begin) - leftCount;
+				if (leftCount == 0 || remaining == 0) continue;
+				float cost = left.halfArea() * testCount(leftCount) + rightCosts[bin + 1];
+				if (cost < best.cost) best = {axis, bin, cost};
+			}
+		}
+		return best;
+	}
+
+	uint32_t partition(uint32_t begin, uint32_t end, const Aabb &centroidBounds, const Split &split) {
+		float axisMin = centroidBounds.min[split.axis];
+		float binsPerUnit = Bvh::BIN_COUNT / (centroidBounds.max[split.axis] - axisMin);
+		auto middle = std::partition(order.begin() + begin, order.begin() + end, [&](uint32_t triangle) {
+			return binOf(centroids[triangle][split.axis], axisMin, binsPerUnit) <= split.bin;
+		});
+		return uint32_t(middle - order.begin());
+	}
+
+	// Halves the triangles along the centroids' longest axis; used where binning can't separate them (they all
+	// have the same centroid) or the tree is getting too deep
+	uint32_t medianSplit(uint32_t begin, uint32_t end, const Aabb &centroidBounds) {
+		glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+		int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+		uint32_t middle = begin + (end - begin) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](uint32_t a, uint32_t b) {
+			return centroids[a][axis] < centroids[b][axis];
+		});
+		return middle;
+	}
+};
+
+// runs body(begin, end) over [0, count) in TRIANGLES_PER_CHUNK sized pieces, on the pool if there is one
+void forEachChunk(ThreadPool *pool, size_t count, const std::function<void(size_t, size_t)> &body) {
+	size_t chunkCount = (count + TRIANGLES_PER_CHUNK - 1) / TRIANGLES_PER_CHUNK;
+	auto chunk = [&](size_t i) { body(i * TRIANGLES_PER_CHUNK, std::min(count, (i + 1) * TRIANGLES_PER_CHUNK)); };
+	if (pool != nullptr) pool->parallelFor(chunkCount, chunk);
+	else for (size_t i = 0; i < chunkCount; i++) chunk(i);
+}
+
+// Walks the tree depth first, so that the SAH cost is summed in the same order however the nodes are laid out
+void gatherStats(const std::vector<BvhNode> &nodes, size_t trianglesPerTest, BvhBuildStats &stats) {
+	struct Visit {
+		uint32_t node;
+		size_t depth;
+	};
+	float rootArea = Aabb{nodes[0].boundsMin, nodes[0].boundsMax}.halfArea();
+	std::vector<Visit> stack = {{0, 0}};
+	while (!stack.empty()) {
+		Visit visit = stack.back();
+		stack.pop_back();
+		const BvhNode &node = nodes[visit.node];
+		stats.maxDepth = std::max(stats.maxDepth, visit.depth);
+		// a flat root (a single triangle, say) makes every ray that hits it test everything once
+		float area = rootArea > 0 ? Aabb{node.boundsMin, node.boundsMax}.halfArea() / rootArea : 1.0f;
+		if (node.isLeaf()) {
+			stats.leafCount++;
+			stats.maxLeafTriangles = std::max<size_t>(stats.maxLeafTriangles, node.triangleCount);
+			stats.sahCost += INTERSECTION_COST * float((node.triangleCount + trianglesPerTest - 1) / trianglesPerTest) * area;
+		} else {
+			stats.sahCost += TRAVERSAL_COST * area;
+			stack.push_back({node.offset + 1, visit.depth + 1});
+			stack.push_back({node.offset, visit.depth + 1});
+		}
+	}
+}
+
+
+// Distance along the ray to where it enters the node's box, or infinity if it misses the box or only reaches it
+// at maxDistance or further
+inline float intersectBounds(const BvhNode &node, const glm::vec3 &origin, const glm::vec3 &inverseDirection, float maxDistance) {
+	glm::vec3 near = (node.boundsMin - origin) * inverseDirection;
+	glm::vec3 far = (node.boundsMax - origin) * inverseDirection;
+	glm::vec3 entry = glm::min(near, far);
+	glm::vec3 exit = glm::max(near, far);
+	float enter = std::max(std::max(entry.x, entry.y), std::max(entry.z, 0.0f));
+	float leave = std::min(std::min(exit.x, exit.y), std::min(exit.z, maxDistance));
+	return enter <= leave ? enter : std::numeric_limits<float>::infinity();
+}
+
+}
+
+Bvh::Bvh(const Mesh &mesh, const BvhBuildOptions &options) {
+	auto start = std::chrono::steady_clock::now();
+	size_t triangleCount = mesh.triangleCount();
+	if (triangleCount == 0) return;
+
+	std::vector<Aabb> triangleBounds(triangleCount);
+	std::vector<glm::vec3> centroids(triangleCount);
+	std::vector<uint32_t> order(triangleCount);
+	forEachChunk(options.pool, triangleCount, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			Aabb bounds;
+			for (int corner = 0; corner < 3; corner++) bounds.grow(mesh.position(mesh.indices[i * 3 + corner]));
+			triangleBounds[i] = bounds;
+			centroids[i] = (bounds.min + bounds.max) * 0.5f;
+			order[i] = uint32_t(i);
+		}
+	});
+
+	// a binary tree with one triangle per leaf has 2n - 1 nodes, which no tree the builder makes can exceed, so
+	// every node can be given its slot up front and the array trimmed afterwards
+	nodes.resize(triangleCount * 2 - 1);
+	std::unique_ptr<TaskGroup> tasks;
+	if (options.pool != nullptr && options.pool->size() > 1) tasks.reset(new TaskGroup(*options.pool));
+	Builder builder(triangleBounds, centroids, order, nodes, options, tasks.get());
+	builder.build(0, 0, uint32_t(triangleCount), 0);
+	if (tasks) tasks->wait();
+	nodes.resize(builder.nodeCount.load());
+	nodes.shrink_to_fit();
+
+	triangles.resize(triangleCount);
+	forEachChunk(options.pool, triangleCount, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			const uint32_t *corners = &mesh.indices[order[i] * 3];
+			glm::vec3 vertex0 = mesh.position(corners[0]);
+			triangles[i] = {vertex0, mesh.position(corners[1]) - vertex0, mesh.position(corners[2]) - vertex0, order[i]};
+		}
+	});
+
+	buildStats.nodeCount = nodes.size();
+	gatherStats(nodes, options.trianglesPerTest, buildStats);
+	buildStats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool Bvh::closestHit(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, BvhHit &hit) const {
+	return traverse<false>(origin, direction, maxDistance, hit);
+}
+
+bool Bvh::anyHit(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, BvhHit &hit) const {
+	return traverse<true>(origin, direction, maxDistance, hit);
+}
+
+// Depth first, visiting the nearer child first. The entry distance of each deferred child is kept on the stack
+// too, so that it can be skipped without touching its node if a closer hit has turned up in the meantime.
+template <bool FirstHitWins>
+bool Bvh::traverse(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, BvhHit &hit) const {
+	if (nodes.empty()) return false;
+	glm::vec3 inverseDirection = 1.0f / direction;
+	float closest = maxDistance;
+	bool found = false;
+
+	struct Deferred {
+		uint32_t node;
+		float distance;
+	};
+	Deferred stack[MAX_DEPTH];
+	size_t stackSize = 0;
+	uint32_t current = 0;
+	if (intersectBounds(nodes[0], origin, inverseDirection, closest) == std::numeric_limits<float>::infinity()) return false;
+
+	while (true) {
+		const BvhNode &node = nodes[current];
+		if (node.isLeaf()) {
+			for (uint32_t i = node.offset; i < node.offset + node.triangleCount; i++) {
+				if (intersectTriangle(triangles[i], origin, direction, closest, hit)) {
+					found = true;
+					closest = hit.distance;
+					if (FirstHitWins) return true;
+				}
+			}
+		} else {
+			float leftDistance = intersectBounds(nodes[node.offset], origin, inverseDirection, closest);
+			float rightDistance = intersectBounds(nodes[node.offset + 1], origin, inverseDirection, closest);
+			bool hitLeft = leftDistance != std::numeric_limits<float>::infinity();
+			bool hitRight = rightDistance != std::numeric_limits<float>::infinity();
+			if (hitLeft && hitRight) {
+				bool leftFirst = leftDistance <= rightDistance;
+				stack[stackSize++] = leftFirst ? Deferred{node.offset + 1, rightDistance} : Deferred{node.offset, leftDistance};
+				current = leftFirst ? node.offset : node.offset + 1;
+				continue;
+			}
+			if (hitLeft || hitRight) {
+				current = hitLeft ? node.offset : node.offset + 1;
+				continue;
+			}
+		}
+
+		// nothing more down this branch, so back up to the nearest deferred node still worth visiting
+		do {
+			if (stackSize == 0) return found;
+			stackSize--;
+		} while (stack[stackSize].distance >= closest);
+		current = stack[stackSize].node;
+	}
+}
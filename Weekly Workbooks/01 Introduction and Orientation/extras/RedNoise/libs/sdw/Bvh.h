@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <glm/glm.hpp>
+#include "Mesh.h"
+
+class ThreadPool;
+
+// Axis aligned bounding box; a default constructed one is empty (and grows to fit whatever is added to it)
+struct Aabb {
+	glm::vec3 min{std::numeric_limits<float>::infinity()};
+	glm::vec3 max{-std::numeric_limits<float>::infinity()};
+
+	void grow(const glm::vec3 &point) {
+		min = glm::min(min, point);
+		max = glm::max(max, point);
+	}
+	void grow(const Aabb &other) {
+		min = glm::min(min, other.min);
+		max = glm::max(max, other.max);
+	}
+	// half the surface area, which is all the SAH needs since only ratios of areas are compared
+	float halfArea() const {
+		glm::vec3 extent = glm::max(max - min, glm::vec3(0));
+		return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+	}
+};
+
+// 32 bytes, so two siblings (which are always stored next to each other) share one cache line
+struct BvhNode {
+	glm::vec3 boundsMin;
+	// the first of the two children of an interior node, or the first triangle (in Bvh order) of a leaf
+	uint32_t offset;
+	glm::vec3 boundsMax;
+	// zero for an interior node
+	uint32_t triangleCount;
+
+	bool isLeaf() const { return triangleCount != 0; }
+};
+
+// A triangle as the intersection test wants it: one corner and the two edges leaving it
+struct BvhTriangle {
+	glm::vec3 vertex0;
+	glm::vec3 edge1;
+	glm::vec3 edge2;
+	// index of the triangle in the mesh the BVH was built from
+	uint32_t index;
+};
+
+struct BvhHit {
+	// along the ray, in multiples of the direction's length
+	float distance;
+	uint32_t triangle;
+	// barycentric weights of the triangle's second and third vertices (the first gets 1 - u - v)
+	float u;
+	float v;
+};
+
+struct BvhBuildOptions {
+	// leaves bigger than this are split even where the SAH says not to
+	size_t maxLeafTriangles = 8;
+	// How many of a leaf's triangles the ray tracer tests at once (see TriangleBlock), so that the SAH can price a
+	// leaf by the number of tests it takes rather than by its number of triangles
+	size_t trianglesPerTest = 1;
+	// Given a pool, big nodes bin their triangles in parallel and subtrees are built as separate tasks. The tree
+	// comes out the same either way (only the order of the nodes in memory differs).
+	ThreadPool *pool = nullptr;
+};
+
+struct BvhBuildStats {
+	double milliseconds = 0;
+	size_t nodeCount = 0;
+	size_t leafCount = 0;
+	size_t maxDepth = 0;
+	size_t maxLeafTriangles = 0;
+	// expected cost of a ray that hits the root, in node visits and triangle tests, by the surface area heuristic
+	float sahCost = 0;
+};
+
+// Bounding volume hierarchy over the triangles of a Mesh, built top down with a binned surface area heuristic: at
+// each node the triangle centroids are dropped into BIN_COUNT bins along each axis and the cheapest of the splits
+// between bins is taken, unless testing every triangle in a single leaf is expected to be cheaper. The BVH keeps
+// its own copy of the triangles, reordered so that each leaf's are contiguous, and doesn't refer back to the mesh.
+class Bvh {
+public:
+	static constexpr int BIN_COUNT = 16;
+	// deep enough for any tree the builder makes, which switches to median splits before it gets this deep
+	static constexpr size_t MAX_DEPTH = 64;
+
+	Bvh() = default;
+	explicit Bvh(const Mesh &mesh, const BvhBuildOptions &options = BvhBuildOptions());
+
+	bool empty() const { return nodes.empty(); }
+	const std::vector<BvhNode> &getNodes() const { return nodes; }
+	const std::vector<BvhTriangle> &getTriangles() const { return triangles; }
+	const BvhBuildStats &stats() const { return buildStats; }
+
+	// Nearest triangle (from either side) that the ray origin + t * direction crosses for 0 < t < maxDistance
+	bool closestHit(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, BvhHit &hit) const;
+	// Any such triangle, found with no attempt to find the nearest, which is all a shadow ray needs to know
+	bool anyHit(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, BvhHit &hit) const;
+
+private:
+	std::vector<BvhNode> nodes;
+	std::vector<BvhTriangle> triangles;
+	BvhBuildStats buildStats;
+
+	template <bool FirstHitWins>
+	bool traverse(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, BvhHit &hit) const;
+};
+
+// Möller-Trumbore: whether the ray crosses the triangle with 0 < t < maxDistance, filling in hit if so
+inline bool intersectTriangle(const BvhTriangle &triangle, const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, BvhHit &hit) {
+	glm::vec3 p = glm::cross(direction, triangle.edge2);
+	float determinant = glm::dot(triangle.edge1, p);
+	// the ray is parallel to the triangle's plane (or the triangle has no area)
+	if (std::abs(determinant) < 1e-12f) return false;
+	float inverseDeterminant = 1.0f / determinant;
+	glm::vec3 fromVertex0 = origin - triangle.vertex0;
+	float u = glm::dot(fromVertex0, p) * inverseDeterminant;
+	if (u < 0.0f || u > 1.0f) return false;
+	glm::vec3 q = glm::cross(fromVertex0, triangle.edge1);
+	float v = glm::dot(direction, q) * inverseDeterminant;
+	if (v < 0.0f || u + v > 1.0f) return false;
+	float t = glm::dot(triangle.edge2, q) * inverseDeterminant;
+	if (!(t > 0.0f && t < maxDistance)) return false;
+	hit = {t, triangle.index, u, v};
+	return true;
+}
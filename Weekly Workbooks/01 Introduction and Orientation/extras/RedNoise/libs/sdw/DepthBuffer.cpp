@@ -0,0 +1,168 @@
+#include <algorithm>
+#include "DepthBuffer.h"
+#include "Simd.h"
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+constexpr int DepthBuffer::BLOCK_SIZE;
+constexpr int DepthBuffer::TILE_SIZE;
+
+// Each row is padded to a multiple of 16 floats (64 bytes), so every row starts on its own cache line
+static size_t paddedStride(size_t width) {
+	return (width + 15) & ~size_t(15);
+}
+
+DepthBuffer::DepthBuffer() : width(0), height(0), stride(0), blocksAcross(0), blocksDown(0), tilesAcross(0), tilesDown(0) {}
+
+DepthBuffer::DepthBuffer(size_t w, size_t h) {
+	resize(w, h);
+}
+
+void DepthBuffer::resize(size_t w, size_t h) {
+	width = w;
+	height = h;
+	stride = paddedStride(w);
+	blocksAcross = (w + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	blocksDown = (h + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	tilesAcross = (w + TILE_SIZE - 1) / TILE_SIZE;
+	tilesDown = (h + TILE_SIZE - 1) / TILE_SIZE;
+	depths.assign(stride * h, 0.0f);
+	blockFarthest.assign(blocksAcross * blocksDown, 0.0f);
+	blockNearest.assign(blocksAcross * blocksDown, 0.0f);
+	tileFarthest.assign(tilesAcross * tilesDown, 0.0f);
+	tileNearest.assign(tilesAcross * tilesDown, 0.0f);
+	blockWritten.assign(blocksAcross * blocksDown, BLOCK_UP_TO_DATE);
+}
+
+void DepthBuffer::clear(float value) {
+	float *data = depths.data();
+	size_t count = depths.size();
+	// The allocation is 64-byte aligned and a whole number of cache lines long, so there is never a remainder
+#if defined(__AVX__)
+	__m256 fill = _mm256_set1_ps(value);
+	for (size_t i = 0; i < count; i += 8) _mm256_store_ps(data + i, fill);
+#elif defined(__SSE2__) || defined(_M_X64)
+	__m128 fill = _mm_set1_ps(value);
+	for (size_t i = 0; i < count; i += 4) _mm_store_ps(data + i, fill);
+#else
+	std::fill(data, data + count, value);
+#endif
+	std::fill(blockFarthest.begin(), blockFarthest.end(), value);
+	std::fill(blockNearest.begin(), blockNearest.end(), value);
+	std::fill(tileFarthest.begin(), tileFarthest.end(), value);
+	std::fill(tileNearest.begin(), tileNearest.end(), value);
+	std::fill(blockWritten.begin(), blockWritten.end(), uint8_t(BLOCK_UP_TO_DATE));
+}
+
+void DepthBuffer::updateHierarchy(int minX, int minY, int maxX, int maxY) {
+	minX = std::max(minX, 0);
+	minY = std::max(minY, 0);
+	maxX = std::min(maxX, int(width) - 1);
+	maxY = std::min(maxY, int(height) - 1);
+	if (minX > maxX || minY > maxY) return;
+
+	// Rescanning every block under a big triangle's bounding box cost more than culling saved, when most of those
+	// blocks are outside the triangle or had every pixel rejected by the depth test
+	for (int tileY = minY / TILE_SIZE; tileY <= maxY / TILE_SIZE; tileY++) {
+		for (int tileX = minX / TILE_SIZE; tileX <= maxX / TILE_SIZE; tileX++) {
+			int firstBlockX = std::max(minX, tileX * TILE_SIZE) / BLOCK_SIZE;
+			int lastBlockX = std::min(maxX, tileX * TILE_SIZE + TILE_SIZE - 1) / BLOCK_SIZE;
+			int firstBlockY = std::max(minY, tileY * TILE_SIZE) / BLOCK_SIZE;
+			int lastBlockY = std::min(maxY, tileY * TILE_SIZE + TILE_SIZE - 1) / BLOCK_SIZE;
+			bool tileWritten = false;
+			for (int blockY = firstBlockY; blockY <= lastBlockY; blockY++) {
+				for (int blockX = firstBlockX; blockX <= lastBlockX; blockX++) {
+					uint8_t &written = blockWritten[blockY * blocksAcross + blockX];
+					if (written == BLOCK_UP_TO_DATE) continue;
+					if (written == BLOCK_STALE) updateBlock(blockX, blockY);
+					written = BLOCK_UP_TO_DATE;
+					tileWritten = true;
+				}
+			}
+			if (tileWritten) updateTile(tileX, tileY);
+		}
+	}
+}
+
+void DepthBuffer::updateBlock(size_t blockX, size_t blockY) {
+	size_t firstRow = blockY * BLOCK_SIZE;
+	size_t lastRow = std::min(firstRow + BLOCK_SIZE, height);
+	size_t firstColumn = blockX * BLOCK_SIZE;
+	size_t lastColumn = std::min(firstColumn + BLOCK_SIZE, width);
+	float farthest;
+	float nearest;
+	if (lastColumn - firstColumn == BLOCK_SIZE && BLOCK_SIZE % SIMD_LANES == 0) {
+		SimdFloat farthestLanes = simdLoad(row(firstRow) + firstColumn);
+		SimdFloat nearestLanes = farthestLanes;
+		for (size_t y = firstRow; y < lastRow; y++) {
+			for (size_t x = firstColumn; x < lastColumn; x += SIMD_LANES) {
+				SimdFloat lanes = simdLoad(row(y) + x);
+				farthestLanes = simdMin(farthestLanes, lanes);
+				nearestLanes = simdMax(nearestLanes, lanes);
+			}
+		}
+		float farthestValues[SIMD_LANES];
+		float nearestValues[SIMD_LANES];
+		simdStore(farthestValues, farthestLanes);
+		simdStore(nearestValues, nearestLanes);
+		farthest = *std::min_element(farthestValues, farthestValues + SIMD_LANES);
+		nearest = *std::max_element(nearestValues, nearestValues + SIMD_LANES);
+	} else {
+		// Blocks on the right hand edge are only partly on the canvas, and the padding must not count
+		farthest = nearest = row(firstRow)[firstColumn];
+		for (size_t y = firstRow; y < lastRow; y++) {
+			for (size_t x = firstColumn; x < lastColumn; x++) {
+				farthest = std::min(farthest, row(y)[x]);
+				nearest = std::max(nearest, row(y)[x]);
+			}
+		}
+	}
+	blockFarthest[blockY * blocksAcross + blockX] = farthest;
+	blockNearest[blockY * blocksAcross + blockX] = nearest;
+}
+
+void DepthBuffer::updateTile(size_t tileX, size_t tileY) {
+	const size_t blocksPerTile = TILE_SIZE / BLOCK_SIZE;
+	size_t firstBlockRow = tileY * blocksPerTile;
+	size_t lastBlockRow = std::min(firstBlockRow + blocksPerTile, blocksDown);
+	size_t firstBlockColumn = tileX * blocksPerTile;
+	size_t lastBlockColumn = std::min(firstBlockColumn + blocksPerTile, blocksAcross);
+	float farthest = blockFarthest[firstBlockRow * blocksAcross + firstBlockColumn];
+	float nearest = blockNearest[firstBlockRow * blocksAcross + firstBlockColumn];
+	for (size_t blockY = firstBlockRow; blockY < lastBlockRow; blockY++) {
+		for (size_t blockX = firstBlockColumn; blockX < lastBlockColumn; blockX++) {
+			farthest = std::min(farthest, blockFarthest[blockY * blocksAcross + blockX]);
+			nearest = std::max(nearest, blockNearest[blockY * blocksAcross + blockX]);
+		}
+	}
+	tileFarthest[tileY * tilesAcross + tileX] = farthest;
+	tileNearest[tileY * tilesAcross + tileX] = nearest;
+}
+
+bool DepthBuffer::isOccluded(int minX, int minY, int maxX, int maxY, float nearestDepth) const {
+	minX = std::max(minX, 0);
+	minY = std::max(minY, 0);
+	maxX = std::min(maxX, int(width) - 1);
+	maxY = std::min(maxY, int(height) - 1);
+	if (minX > maxX || minY > maxY) return false;
+
+	// The comparison is strict so that depths that are equal up to rounding are left to the per-pixel test
+	for (int tileY = minY / TILE_SIZE; tileY <= maxY / TILE_SIZE; tileY++) {
+		for (int tileX = minX / TILE_SIZE; tileX <= maxX / TILE_SIZE; tileX++) {
+			if (nearestDepth < tileFarthest[tileY * tilesAcross + tileX]) continue;
+
+			// The tile as a whole isn't enough, so look at the blocks of the tile that the rectangle covers
+			int firstBlockX = std::max(minX, tileX * TILE_SIZE) / BLOCK_SIZE;
+			int lastBlockX = std::min(maxX, tileX * TILE_SIZE + TILE_SIZE - 1) / BLOCK_SIZE;
+			int firstBlockY = std::max(minY, tileY * TILE_SIZE) / BLOCK_SIZE;
+			int lastBlockY = std::min(maxY, tileY * TILE_SIZE + TILE_SIZE - 1) / BLOCK_SIZE;
+			for (int blockY = firstBlockY; blockY <= lastBlockY; blockY++) {
+				for (int blockX = firstBlockX; blockX <= lastBlockX; blockX++) {
+					if (!(nearestDepth < blockFarthest[blockY * blocksAcross + blockX])) return false;
+				}
+			}
+		}
+	}
+	return true;
+}
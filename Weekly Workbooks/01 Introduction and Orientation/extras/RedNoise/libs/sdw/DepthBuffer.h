@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "AlignedAllocator.h"
+
+// Per-pixel depth storage for a render target. Depths are stored as 1/z (bigger is closer), so a cleared buffer
+// holds 0.0 everywhere. The buffer is a single 64-byte aligned allocation with every row padded out to a whole
+// number of cache lines, which keeps it reusable across frames and lets each row be processed with aligned SIMD.
+//
+// On top of the pixels sits a two level depth hierarchy (8x8 blocks and 64x64 tiles), each entry holding the
+// farthest and nearest depth stored underneath it. Rasterisers use it to throw away triangles or blocks that are
+// entirely behind what has already been drawn. The hierarchy is only as fresh as the last updateHierarchy call, which
+// only recomputes the blocks that whoever wrote the depths marked as written.
+class DepthBuffer {
+public:
+	static constexpr int BLOCK_SIZE = 8;
+	static constexpr int TILE_SIZE = 64;
+
+	size_t width;
+	size_t height;
+	// Distance (in floats) between the start of one row and the start of the next
+	size_t stride;
+	size_t blocksAcross;
+	size_t blocksDown;
+	size_t tilesAcross;
+	size_t tilesDown;
+
+private:
+	std::vector<float, AlignedAllocator<float, 64>> depths;
+	std::vector<float> blockFarthest;
+	std::vector<float> blockNearest;
+	std::vector<float> tileFarthest;
+	std::vector<float> tileNearest;
+	// One per block, saying what updateHierarchy still has to do for it: nothing, recompute its tile, or recompute
+	// the block itself (and then its tile)
+	enum : uint8_t { BLOCK_UP_TO_DATE, BLOCK_TILE_STALE, BLOCK_STALE };
+	std::vector<uint8_t> blockWritten;
+
+	void updateBlock(size_t blockX, size_t blockY);
+	void updateTile(size_t tileX, size_t tileY);
+
+public:
+	DepthBuffer();
+	DepthBuffer(size_t w, size_t h);
+	void resize(size_t w, size_t h);
+	void clear(float value = 0.0f);
+	float *row(size_t y) { return depths.data() + y * stride; }
+	const float *row(size_t y) const { return depths.data() + y * stride; }
+	float getDepth(size_t x, size_t y) const { return depths[y * stride + x]; }
+	void setDepth(size_t x, size_t y, float depth) { depths[y * stride + x] = depth; }
+
+	// Marks the blocks holding pixels minX to maxX of row y (all on the buffer) as having had depths written to them
+	void markWritten(int minX, int y, int maxX) {
+		uint8_t *written = blockWritten.data() + size_t(y / BLOCK_SIZE) * blocksAcross;
+		std::fill(written + minX / BLOCK_SIZE, written + maxX / BLOCK_SIZE + 1, uint8_t(BLOCK_STALE));
+	}
+	// For a rasteriser that has just written every pixel of a block and kept track of the farthest and nearest depth
+	// it left there, which saves updateHierarchy reading the block back
+	void setBlockDepths(size_t blockX, size_t blockY, float farthest, float nearest) {
+		size_t block = blockY * blocksAcross + blockX;
+		blockFarthest[block] = farthest;
+		blockNearest[block] = nearest;
+		blockWritten[block] = BLOCK_TILE_STALE;
+	}
+	// Recomputes the blocks that overlap the inclusive pixel rectangle and have been marked as written since they
+	// were last computed, and the tiles they are in
+	void updateHierarchy(int minX, int minY, int maxX, int maxY);
+	// True when every pixel in the inclusive rectangle already holds a depth closer than nearestDepth
+	bool isOccluded(int minX, int minY, int maxX, int maxY, float nearestDepth) const;
+	float farthestInBlock(size_t blockX, size_t blockY) const { return blockFarthest[blockY * blocksAcross + blockX]; }
+	float nearestInBlock(size_t blockX, size_t blockY) const { return blockNearest[blockY * blocksAcross + blockX]; }
+};
@@ -1,93 +1,120 @@
-#include <array>
 #include "DrawingWindow.h"
 // On some platforms you may need to include <cstring> (if you compiler can't find memset !)
 
 DrawingWindow::DrawingWindow() {}
 
-DrawingWindow::DrawingWindow(int w, int h, bool fullscreen) : width(w), height(h), pixelBuffer(w * h) {
+DrawingWindow::DrawingWindow(int w, int h, bool fullscreen, PresentMode mode) : RenderTarget(w, h), presentMode(mode) {
 	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0) printMessageAndQuit("Could not initialise SDL: ", SDL_GetError());
 	uint32_t flags = SDL_WINDOW_OPENGL;
 	if (fullscreen) flags |= SDL_WINDOW_FULLSCREEN_DESKTOP;
 	int ANYWHERE = SDL_WINDOWPOS_UNDEFINED;
 	window = SDL_CreateWindow("COMS30020", ANYWHERE, ANYWHERE, width, height, flags);
 	if (!window) printMessageAndQuit("Could not set video mode: ", SDL_GetError());
-	// Set rendering to software (hardware acceleration doesn't work on all platforms)
-	flags = SDL_RENDERER_SOFTWARE;
-	// You could try hardware acceleration if you like - by uncommenting the below line
-	// flags = SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC;
-	renderer = SDL_CreateRenderer(window, -1, flags);
+
+	if (presentMode == PresentMode::Copy) {
+		pixelBuffer.assign(stride * height, 0);
+		pixels = pixelBuffer.data();
+		createRenderer(SDL_TEXTUREACCESS_STATIC);
+	} else {
+		createRenderer(SDL_TEXTUREACCESS_STREAMING);
+		lockStreamingTexture();
+	}
+}
+
+DrawingWindow::~DrawingWindow() {
+	destroy();
+}
+
+void DrawingWindow::createRenderer(uint32_t textureAccess) {
+	if (presentMode == PresentMode::Copy) {
+		// Set rendering to software (hardware acceleration doesn't work on all platforms)
+		renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+	} else {
+		// Streaming mode tries hardware acceleration first
+		renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+		if (!renderer) renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+	}
 	if (!renderer) printMessageAndQuit("Could not create renderer: ", SDL_GetError());
 	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
 	SDL_RenderSetLogicalSize(renderer, width, height);
 	int PIXELFORMAT = SDL_PIXELFORMAT_ARGB8888;
-	texture = SDL_CreateTexture(renderer, PIXELFORMAT, SDL_TEXTUREACCESS_STATIC, width, height);
+	// As wide as a padded row, so that a locked streaming texture has room for the padding too; only the first
+	// `width` columns are ever shown
+	texture = SDL_CreateTexture(renderer, PIXELFORMAT, textureAccess, stride, height);
 	if (!texture) printMessageAndQuit("Could not allocate texture: ", SDL_GetError());
 }
 
+void DrawingWindow::lockStreamingTexture() {
+	void *lockedPixels;
+	int pitch;
+	if (SDL_LockTexture(texture, nullptr, &lockedPixels, &pitch) != 0) printMessageAndQuit("Could not lock texture: ", SDL_GetError());
+	pixels = static_cast<uint32_t *>(lockedPixels);
+	stride = size_t(pitch) / sizeof(uint32_t);
+}
+
 void DrawingWindow::renderFrame() {
-	SDL_UpdateTexture(texture, nullptr, pixelBuffer.data(), width * sizeof(uint32_t));
-	SDL_RenderClear(renderer);
-	SDL_RenderCopy(renderer, texture, nullptr, nullptr);
-	SDL_RenderPresent(renderer);
+	if (presentMode == PresentMode::Copy) {
+		SDL_UpdateTexture(texture, nullptr, pixels, stride * sizeof(uint32_t));
+		presentTexture();
+	} else {
+		SDL_UnlockTexture(texture);
+		presentTexture();
+		lockStreamingTexture();
+	}
 }
 
-void DrawingWindow::saveBMP(const std::string &filename) const {
-	auto surface = SDL_CreateRGBSurfaceFrom((void *) pixelBuffer.data(), width, height, 32,
-	                                        width * sizeof(uint32_t),
-	                                        0xFF << 16, 0xFF << 8, 0xFF << 0, 0xFF << 24);
-	SDL_SaveBMP(surface, filename.c_str());
+bool DrawingWindow::presentAgain() {
+	if (presentMode == PresentMode::Streaming) return false;
+	// the texture still holds the last frame
+	presentTexture();
+	return true;
 }
 
-void DrawingWindow::savePPM(const std::string &filename) const {
-	std::ofstream outputStream(filename, std::ofstream::out);
-	outputStream << "P6\n";
-	outputStream << width << " " << height << "\n";
-	outputStream << "255\n";
+std::shared_ptr<const Image> DrawingWindow::snapshotLastFrame() {
+	if (presentMode == PresentMode::Streaming) return nullptr;
+	return snapshot();
+}
 
-	for (size_t i = 0; i < width * height; i++) {
-		std::array<char, 3> rgb {{
-				static_cast<char> ((pixelBuffer[i] >> 16) & 0xFF),
-				static_cast<char> ((pixelBuffer[i] >> 8) & 0xFF),
-				static_cast<char> ((pixelBuffer[i] >> 0) & 0xFF)
-		}};
-		outputStream.write(rgb.data(), 3);
-	}
-	outputStream.close();
+void DrawingWindow::presentTexture() {
+	SDL_Rect shown = {0, 0, int(width), int(height)};
+	SDL_RenderClear(renderer);
+	SDL_RenderCopy(renderer, texture, &shown, nullptr);
+	SDL_RenderPresent(renderer);
 }
 
-bool DrawingWindow::pollForInputEvents(SDL_Event &event) {
-	if (SDL_PollEvent(&event)) {
-		if ((event.type == SDL_QUIT) || ((event.type == SDL_KEYDOWN) && (event.key.keysym.sym == SDLK_ESCAPE))) {
-			SDL_DestroyTexture(texture);
-			SDL_DestroyRenderer(renderer);
-			SDL_DestroyWindow(window);
-			SDL_Quit();
-			printMessageAndQuit("Exiting", nullptr);
-		}
-		SDL_Event dummy;
-		// Clear the event queue by getting all available events
-		// This seems like bad practice (because it will skip some events) however preventing backlog is paramount !
-		while (SDL_PollEvent(&dummy));
-		return true;
-	}
-	return false;
+void DrawingWindow::destroy() {
+	if (texture && presentMode == PresentMode::Streaming) SDL_UnlockTexture(texture);
+	if (texture) SDL_DestroyTexture(texture);
+	if (renderer) SDL_DestroyRenderer(renderer);
+	if (window) SDL_DestroyWindow(window);
+	texture = nullptr;
+	renderer = nullptr;
+	window = nullptr;
+	pixels = nullptr;
 }
 
-void DrawingWindow::setPixelColour(size_t x, size_t y, uint32_t colour) {
-	if ((x >= width) || (y >= height)) {
-		std::cout << x << "," << y << " not on visible screen area" << std::endl;
-	} else pixelBuffer[(y * width) + x] = colour;
+bool DrawingWindow::pollForInputEvents(SDL_Event &event) {
+	if (SDL_PollEvent(&event)) return takeInputEvents(event);
+	return false;
 }
 
-uint32_t DrawingWindow::getPixelColour(size_t x, size_t y) {
-	if ((x >= width) || (y >= height)) {
-		std::cout << x << "," << y << " not on visible screen area" << std::endl;
-		return -1;
-	} else return pixelBuffer[(y * width) + x];
+bool DrawingWindow::waitForInputEvents(SDL_Event &event, int timeoutMilliseconds) {
+	if (SDL_WaitEventTimeout(&event, timeoutMilliseconds)) return takeInputEvents(event);
+	return false;
 }
 
-void DrawingWindow::clearPixels() {
-	std::fill(pixelBuffer.begin(), pixelBuffer.end(), 0);
+// Quits on the event if it asks to, otherwise empties the queue behind it
+bool DrawingWindow::takeInputEvents(SDL_Event &event) {
+	if ((event.type == SDL_QUIT) || ((event.type == SDL_KEYDOWN) && (event.key.keysym.sym == SDLK_ESCAPE))) {
+		destroy();
+		SDL_Quit();
+		printMessageAndQuit("Exiting", nullptr);
+	}
+	SDL_Event dummy;
+	// Clear the event queue by getting all available events
+	// This seems like bad practice (because it will skip some events) however preventing backlog is paramount !
+	while (SDL_PollEvent(&dummy));
+	return true;
 }
 
 void printMessageAndQuit(const std::string &message, const char *error) {
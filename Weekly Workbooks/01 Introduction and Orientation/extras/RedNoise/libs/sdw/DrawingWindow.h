@@ -4,29 +4,55 @@
 #include <fstream>
 #include <vector>
 #include "SDL.h"
+#include "RenderTarget.h"
 
-class DrawingWindow {
+// How finished frames get from the pixels that were drawn to the screen. Both modes upload and present from the
+// thread that calls renderFrame, which has to be the one that made the window: SDL renderers can't be used from any
+// other thread on macOS, or with the OpenGL and Metal backends.
+enum class PresentMode {
+	// Draw into a buffer which renderFrame copies into a static texture (the original behaviour)
+	Copy,
+	// Draw straight into a locked streaming texture, which renderFrame unlocks, presents and locks again, so the
+	// pixels are never copied on the way to the renderer. What is in the texture once it's locked again is
+	// undefined, so the frame that was shown is gone and has to be drawn again to be shown or copied again.
+	Streaming
+};
 
-public:
-	size_t width;
-	size_t height;
+// A render target shown in an SDL window. In Streaming mode `stride` is whatever pitch the locked texture has,
+// which can change from frame to frame.
+class DrawingWindow : public RenderTarget {
 
 private:
-	SDL_Window *window;
-	SDL_Renderer *renderer;
-	SDL_Texture *texture;
-	std::vector<uint32_t> pixelBuffer;
+	SDL_Window *window = nullptr;
+	SDL_Renderer *renderer = nullptr;
+	SDL_Texture *texture = nullptr;
+	PresentMode presentMode = PresentMode::Copy;
+	// Copy mode only; in Streaming mode `pixels` points at the locked texture instead
+	PixelBuffer pixelBuffer;
 
 public:
 	DrawingWindow();
-	DrawingWindow(int w, int h, bool fullscreen);
+	DrawingWindow(int w, int h, bool fullscreen, PresentMode mode = PresentMode::Copy);
+	~DrawingWindow() override;
 	void renderFrame();
-	void savePPM(const std::string &filename) const;
-	void saveBMP(const std::string &filename) const;
+	// Shows the last frame renderFrame was given again, without it being drawn again, for when the window has been
+	// uncovered. Returns false in Streaming mode, where that frame is gone once it has been shown, so it has to be
+	// drawn again.
+	bool presentAgain();
+	// Copies the last frame renderFrame was given, as long as nothing has been drawn since. Returns null in Streaming
+	// mode, where that frame is gone: draw it again and take a snapshot() instead.
+	std::shared_ptr<const Image> snapshotLastFrame();
+	// Takes the first event that is waiting (and throws the rest away), returning false if there isn't one
 	bool pollForInputEvents(SDL_Event &event);
-	void setPixelColour(size_t x, size_t y, uint32_t colour);
-	uint32_t getPixelColour(size_t x, size_t y);
-	void clearPixels();
+	// The same, but waits up to timeoutMilliseconds for an event if there isn't one, sleeping rather than spinning
+	bool waitForInputEvents(SDL_Event &event, int timeoutMilliseconds);
+
+private:
+	void createRenderer(uint32_t textureAccess);
+	void presentTexture();
+	bool takeInputEvents(SDL_Event &event);
+	void lockStreamingTexture();
+	void destroy();
 };
 
 void printMessageAndQuit(const std::string &message, const char *error);
@@ -0,0 +1,176 @@
+#include "ImageWriter.h"
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+namespace {
+
+// Enough spare bytes after the end of a buffer for the widest store packRgb makes past the bytes it means to write
+constexpr size_t STORE_SLACK = 16;
+
+void writeFile(const std::string &filename, const std::vector<char> &bytes, size_t size) {
+	std::FILE *file = std::fopen(filename.c_str(), "wb");
+	if (file == nullptr) throw std::runtime_error("Failed to open `" + filename + "` for writing");
+	// Unbuffered so that the whole image goes to the OS in one write rather than a stdio buffer's worth at a time
+	std::setvbuf(file, nullptr, _IONBF, 0);
+	bool written = std::fwrite(bytes.data(), 1, size, file) == size;
+	if (std::fclose(file) != 0) written = false;
+	if (!written) throw std::runtime_error("Failed to write `" + filename + "`");
+}
+
+size_t writeHeader(std::vector<char> &bytes, const std::string &header) {
+	std::memcpy(bytes.data(), header.data(), header.size());
+	return header.size();
+}
+
+// Packs count 0xAARRGGBB pixels into R, G, B bytes. The SSSE3 loop shuffles four pixels at a time into the low
+// 12 bytes of a register and stores all 16, so it can write up to STORE_SLACK bytes past destination + 3 * count.
+void packRgb(const uint32_t *source, size_t count, char *destination) {
+	size_t x = 0;
+#if defined(__SSSE3__)
+	const __m128i toRgb = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	for (; x + 4 <= count; x += 4) {
+		__m128i argb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + x));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(destination + 3 * x), _mm_shuffle_epi8(argb, toRgb));
+	}
+#endif
+	for (; x < count; x++) {
+		destination[3 * x + 0] = char((source[x] >> 16) & 0xFF);
+		destination[3 * x + 1] = char((source[x] >> 8) & 0xFF);
+		destination[3 * x + 2] = char((source[x] >> 0) & 0xFF);
+	}
+}
+
+void putLittleEndian(char *destination, uint32_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) destination[i] = char((value >> (8 * i)) & 0xFF);
+}
+
+std::string extensionOf(const std::string &filename) {
+	size_t dot = filename.find_last_of('.');
+	if (dot == std::string::npos || filename.find_first_of("/\\", dot) != std::string::npos) return "";
+	std::string extension = filename.substr(dot + 1);
+	for (char &c : extension) c = char(std::tolower(static_cast<unsigned char>(c)));
+	return extension;
+}
+
+}
+
+void writePPM(const std::string &filename, const uint32_t *pixels, size_t width, size_t height, size_t stride) {
+	std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+	size_t size = header.size() + width * height * 3;
+	std::vector<char> bytes(size + STORE_SLACK);
+	char *destination = bytes.data() + writeHeader(bytes, header);
+	// Rows go out in order, so each row's overrun lands on the start of the next row before that is written
+	for (size_t y = 0; y < height; y++) packRgb(pixels + y * stride, width, destination + y * width * 3);
+	writeFile(filename, bytes, size);
+}
+
+void writeBMP(const std::string &filename, const uint32_t *pixels, size_t width, size_t height, size_t stride) {
+	const size_t fileHeaderSize = 14;
+	const size_t infoHeaderSize = 40;
+	size_t rowSize = width * sizeof(uint32_t);
+	size_t size = fileHeaderSize + infoHeaderSize + rowSize * height;
+	if (size > UINT32_MAX) throw std::runtime_error("`" + filename + "` is too big for a BMP file");
+
+	std::vector<char> bytes(size);
+	char *header = bytes.data();
+	header[0] = 'B';
+	header[1] = 'M';
+	putLittleEndian(header + 2, uint32_t(size), 4);
+	putLittleEndian(header + 10, uint32_t(fileHeaderSize + infoHeaderSize), 4);
+	char *info = header + fileHeaderSize;
+	putLittleEndian(info + 0, uint32_t(infoHeaderSize), 4);
+	putLittleEndian(info + 4, uint32_t(width), 4);
+	putLittleEndian(info + 8, uint32_t(height), 4);
+	putLittleEndian(info + 12, 1, 2);
+	putLittleEndian(info + 14, 32, 2);
+	// everything else (no compression, default resolution and palette) is left as zeros
+
+	// BMP rows run bottom to top, and each 0xAARRGGBB pixel is already B, G, R, A in (little endian) memory
+	char *destination = info + infoHeaderSize;
+	for (size_t y = 0; y < height; y++) {
+		std::memcpy(destination + y * rowSize, pixels + (height - 1 - y) * stride, rowSize);
+	}
+	writeFile(filename, bytes, size);
+}
+
+void writePFM(const std::string &filename, const uint32_t *pixels, size_t width, size_t height, size_t stride) {
+	// a negative scale marks the floats as little endian
+	std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+	size_t size = header.size() + width * height * 3 * sizeof(float);
+	std::vector<char> bytes(size);
+	char *destination = bytes.data() + writeHeader(bytes, header);
+
+	std::vector<float> row(width * 3);
+	for (size_t y = 0; y < height; y++) {
+		const uint32_t *source = pixels + (height - 1 - y) * stride;
+		for (size_t x = 0; x < width; x++) {
+			row[3 * x + 0] = float((source[x] >> 16) & 0xFF) / 255.0f;
+			row[3 * x + 1] = float((source[x] >> 8) & 0xFF) / 255.0f;
+			row[3 * x + 2] = float((source[x] >> 0) & 0xFF) / 255.0f;
+		}
+		std::memcpy(destination + y * row.size() * sizeof(float), row.data(), row.size() * sizeof(float));
+	}
+	writeFile(filename, bytes, size);
+}
+
+void writeImage(const std::string &filename, const uint32_t *pixels, size_t width, size_t height, size_t stride) {
+	std::string extension = extensionOf(filename);
+	if (extension == "ppm") writePPM(filename, pixels, width, height, stride);
+	else if (extension == "bmp") writeBMP(filename, pixels, width, height, stride);
+	else if (extension == "pfm") writePFM(filename, pixels, width, height, stride);
+	else throw std::invalid_argument("Don't know how to write `" + filename + "` (expected .ppm, .bmp or .pfm)");
+}
+
+void writeImage(const std::string &filename, const Image &image) {
+	writeImage(filename, image.pixels.data(), image.width, image.height, image.width);
+}
+
+AsyncImageWriter::AsyncImageWriter() : writer(&AsyncImageWriter::writeLoop, this) {}
+
+AsyncImageWriter::~AsyncImageWriter() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_one();
+	writer.join();
+}
+
+void AsyncImageWriter::enqueue(std::shared_ptr<const Image> image, const std::string &filename) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back({std::move(image), filename});
+	}
+	wake.notify_one();
+}
+
+void AsyncImageWriter::waitUntilIdle() {
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [this] { return jobs.empty() && !writing; });
+}
+
+void AsyncImageWriter::writeLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+		if (jobs.empty()) break;
+		Job job = std::move(jobs.front());
+		jobs.pop_front();
+		writing = true;
+		lock.unlock();
+		try {
+			writeImage(job.filename, *job.image);
+		} catch (const std::exception &e) {
+			std::cerr << "Couldn't save " << job.filename << ": " << e.what() << std::endl;
+		}
+		lock.lock();
+		writing = false;
+		if (jobs.empty()) idle.notify_all();
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A copy of some 0xAARRGGBB pixels with no row padding, taken so they can be written out after the buffer they
+// came from has moved on to the next frame
+struct Image {
+	size_t width = 0;
+	size_t height = 0;
+	std::vector<uint32_t> pixels;
+};
+
+// Each writer converts the whole image into one buffer in the file's layout and hands it to the OS in a single
+// write, throwing std::runtime_error if the file can't be written. `stride` is the distance in pixels between
+// the start of one row and the next.
+void writePPM(const std::string &filename, const uint32_t *pixels, size_t width, size_t height, size_t stride);
+// 32 bits per pixel, which is the byte order the pixels already have in memory, so rows are copied as they are
+void writeBMP(const std::string &filename, const uint32_t *pixels, size_t width, size_t height, size_t stride);
+// Three floats per pixel in [0, 1], bottom row first as the format requires
+void writePFM(const std::string &filename, const uint32_t *pixels, size_t width, size_t height, size_t stride);
+// Picks one of the above from the file's extension (.ppm, .bmp or .pfm), throwing std::invalid_argument otherwise
+void writeImage(const std::string &filename, const uint32_t *pixels, size_t width, size_t height, size_t stride);
+void writeImage(const std::string &filename, const Image &image);
+
+// Writes images on a thread of its own, so that saving a frame only costs the render loop the copy it takes with
+// RenderTarget::snapshot. Anything still queued when the writer is destroyed is written before the destructor
+// returns. There's nobody to hand an error to by the time a write fails, so failures are reported on std::cerr.
+class AsyncImageWriter {
+public:
+	AsyncImageWriter();
+	~AsyncImageWriter();
+	AsyncImageWriter(const AsyncImageWriter &) = delete;
+	AsyncImageWriter &operator=(const AsyncImageWriter &) = delete;
+
+	// Queues the image to be written to filename; the same snapshot can be queued under several names
+	void enqueue(std::shared_ptr<const Image> image, const std::string &filename);
+	// Blocks until everything queued so far has been written
+	void waitUntilIdle();
+
+private:
+	struct Job {
+		std::shared_ptr<const Image> image;
+		std::string filename;
+	};
+
+	void writeLoop();
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	std::deque<Job> jobs;
+	bool writing = false;
+	bool stopping = false;
+	// started last, once everything it uses has been constructed
+	std::thread writer;
+};
@@ -0,0 +1,104 @@
+#include "MappedFile.h"
+#include <stdexcept>
+#include <utility>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile(const std::string &filename) {
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("Failed to open `" + filename + "`");
+	fileHandle = file;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		unmap();
+		throw std::runtime_error("Failed to read the size of `" + filename + "`");
+	}
+	length = size_t(fileSize.QuadPart);
+	if (length == 0) return;
+
+	mappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mappingHandle != nullptr) bytes = static_cast<const char *>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+	if (bytes == nullptr) {
+		unmap();
+		throw std::runtime_error("Failed to map `" + filename + "`");
+	}
+}
+
+void MappedFile::unmap() {
+	if (bytes != nullptr) UnmapViewOfFile(bytes);
+	if (mappingHandle != nullptr) CloseHandle(mappingHandle);
+	if (fileHandle != nullptr) CloseHandle(fileHandle);
+	bytes = nullptr;
+	length = 0;
+	mappingHandle = nullptr;
+	fileHandle = nullptr;
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &filename) {
+	int file = open(filename.c_str(), O_RDONLY);
+	if (file < 0) throw std::runtime_error("Failed to open `" + filename + "`");
+
+	struct stat status {};
+	if (fstat(file, &status) != 0) {
+		close(file);
+		throw std::runtime_error("Failed to read the size of `" + filename + "`");
+	}
+	length = size_t(status.st_size);
+	if (length == 0) {
+		close(file);
+		return;
+	}
+
+	void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0);
+	// the mapping keeps its own reference to the file, so the descriptor isn't needed any more
+	close(file);
+	if (mapping == MAP_FAILED) {
+		length = 0;
+		throw std::runtime_error("Failed to map `" + filename + "`");
+	}
+	// the file is read from front to back, so let the kernel read ahead aggressively
+	madvise(mapping, length, MADV_SEQUENTIAL);
+	bytes = static_cast<const char *>(mapping);
+}
+
+void MappedFile::unmap() {
+	if (bytes != nullptr) munmap(const_cast<char *>(bytes), length);
+	bytes = nullptr;
+	length = 0;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+	unmap();
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept {
+	*this = std::move(other);
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+	if (this != &other) {
+		unmap();
+		std::swap(bytes, other.bytes);
+		std::swap(length, other.length);
+#if defined(_WIN32)
+		std::swap(fileHandle, other.fileHandle);
+		std::swap(mappingHandle, other.mappingHandle);
+#endif
+	}
+	return *this;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Read-only memory mapping of a whole file, so that it can be parsed in place without copying it into memory
+// first. Throws std::runtime_error if the file can't be opened or mapped. An empty file maps to an empty view.
+class MappedFile {
+public:
+	MappedFile() = default;
+	explicit MappedFile(const std::string &filename);
+	~MappedFile();
+	MappedFile(MappedFile &&other) noexcept;
+	MappedFile &operator=(MappedFile &&other) noexcept;
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	const char *data() const { return bytes; }
+	size_t size() const { return length; }
+	std::string_view view() const { return std::string_view(bytes, length); }
+
+private:
+	const char *bytes = nullptr;
+	size_t length = 0;
+#if defined(_WIN32)
+	void *fileHandle = nullptr;
+	void *mappingHandle = nullptr;
+#endif
+	void unmap();
+};
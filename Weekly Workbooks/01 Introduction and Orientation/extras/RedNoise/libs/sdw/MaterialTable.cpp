@@ -0,0 +1,23 @@
+#include "MaterialTable.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+MaterialIndex MaterialTable::add(const std::string &name, const glm::vec3 &diffuse, const TextureMap *texture) {
+	if (materials.size() == MAX_MATERIALS) throw std::length_error("too many materials (at most " + std::to_string(MAX_MATERIALS) + ")");
+
+	Material material;
+	material.argb = packArgb(diffuse);
+	material.albedo = glm::clamp(diffuse, glm::vec3(0), glm::vec3(1));
+	material.texture = texture;
+	if (texture != nullptr) material.flags |= MATERIAL_TEXTURED;
+
+	materials.push_back(material);
+	names.push_back(name);
+	return MaterialIndex(materials.size() - 1);
+}
+
+uint32_t packArgb(const glm::vec3 &colour) {
+	auto channel = [](float value) { return uint32_t(std::min(std::max(int(std::round(value * 255)), 0), 255)); };
+	return (255u << 24) | (channel(colour.r) << 16) | (channel(colour.g) << 8) | channel(colour.b);
+}
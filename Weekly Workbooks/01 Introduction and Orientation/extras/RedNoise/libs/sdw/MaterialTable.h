@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+class TextureMap;
+
+// Triangles refer to their material by its position in a MaterialTable
+typedef uint16_t MaterialIndex;
+
+enum MaterialFlags : uint16_t {
+	MATERIAL_TEXTURED = 1 << 0
+};
+
+// Everything the shading code needs to know about a material, worked out once when the material is added so that
+// nothing has to be converted (or looked up by name) per triangle or per pixel
+struct Material {
+	// diffuse colour as 0xAARRGGBB with full alpha, ready to be written to the window
+	uint32_t argb{};
+	// diffuse reflectance as linear floats in [0, 1], straight from the mtl file's Kd
+	glm::vec3 albedo{};
+	// texture to sample instead of argb, or null; MATERIAL_TEXTURED is set exactly when this isn't null
+	const TextureMap *texture{};
+	uint16_t flags{};
+
+	bool hasFlag(MaterialFlags flag) const { return (flags & flag) != 0; }
+};
+
+class MaterialTable {
+public:
+	static constexpr size_t MAX_MATERIALS = size_t(UINT16_MAX) + 1;
+
+	// Adds a material and returns its index, throwing std::length_error once MAX_MATERIALS are in use
+	MaterialIndex add(const std::string &name, const glm::vec3 &diffuse, const TextureMap *texture = nullptr);
+	const Material &operator[](MaterialIndex index) const { return materials[index]; }
+	const std::string &name(MaterialIndex index) const { return names[index]; }
+	size_t size() const { return materials.size(); }
+
+private:
+	std::vector<Material> materials;
+	// kept apart from the materials, which are what the shading code actually reads
+	std::vector<std::string> names;
+};
+
+uint32_t packArgb(const glm::vec3 &colour);
@@ -0,0 +1,78 @@
+#include "Mesh.h"
+#include <unordered_map>
+
+namespace {
+
+struct CornerKey {
+	uint32_t position;
+	uint32_t textureCoordinate;
+	uint32_t normal;
+
+	bool operator==(const CornerKey &other) const {
+		return position == other.position && textureCoordinate == other.textureCoordinate && normal == other.normal;
+	}
+};
+
+struct CornerKeyHash {
+	size_t operator()(const CornerKey &key) const {
+		uint64_t hash = key.position;
+		hash = hash * 0x9E3779B97F4A7C15ull ^ key.textureCoordinate;
+		hash = hash * 0x9E3779B97F4A7C15ull ^ key.normal;
+		return size_t(hash ^ (hash >> 32));
+	}
+};
+
+}
+
+Mesh buildMesh(const ObjModelView &model, float scale, const MeshMaterialMapping &materialFor) {
+	Mesh mesh;
+	mesh.indices.reserve(model.triangles.size() * 3);
+	mesh.materials.reserve(model.triangles.size());
+
+	// Most positions are only ever used with one texture coordinate and normal, so the first combination seen
+	// for each position is remembered in a flat array and only the exceptions (seams) go through the hash map
+	std::vector<uint32_t> firstVertex(model.positions.size(), ObjTriangle::NO_INDEX);
+	std::vector<CornerKey> firstKeys(model.positions.size());
+	std::unordered_map<CornerKey, uint32_t, CornerKeyHash> seamVertices;
+
+	auto addVertex = [&](const CornerKey &key) {
+		auto vertex = uint32_t(mesh.positionX.size());
+		glm::vec3 position = model.positions[key.position] * scale;
+		glm::vec2 textureCoordinate = key.textureCoordinate == ObjTriangle::NO_INDEX ? glm::vec2(0) : model.textureCoordinates[key.textureCoordinate];
+		glm::vec3 normal = key.normal == ObjTriangle::NO_INDEX ? glm::vec3(0) : model.normals[key.normal];
+		mesh.positionX.push_back(position.x);
+		mesh.positionY.push_back(position.y);
+		mesh.positionZ.push_back(position.z);
+		mesh.textureU.push_back(textureCoordinate.x);
+		mesh.textureV.push_back(textureCoordinate.y);
+		mesh.normalX.push_back(normal.x);
+		mesh.normalY.push_back(normal.y);
+		mesh.normalZ.push_back(normal.z);
+		return vertex;
+	};
+	auto vertexFor = [&](const CornerKey &key) {
+		uint32_t &first = firstVertex[key.position];
+		if (first == ObjTriangle::NO_INDEX) {
+			first = addVertex(key);
+			firstKeys[key.position] = key;
+			return first;
+		}
+		if (key.textureCoordinate == firstKeys[key.position].textureCoordinate && key.normal == firstKeys[key.position].normal) return first;
+		auto found = seamVertices.find(key);
+		if (found != seamVertices.end()) return found->second;
+		uint32_t vertex = addVertex(key);
+		seamVertices.emplace(key, vertex);
+		return vertex;
+	};
+
+	for (const auto &triangle : model.triangles) {
+		bool hasTextureCoordinates = true;
+		for (int i = 0; i < 3; i++) {
+			CornerKey key{triangle.positions[i], triangle.textureCoordinates[i], triangle.normals[i]};
+			mesh.indices.push_back(vertexFor(key));
+			hasTextureCoordinates = hasTextureCoordinates && key.textureCoordinate != ObjTriangle::NO_INDEX;
+		}
+		mesh.materials.push_back(materialFor(triangle.material, hasTextureCoordinates));
+	}
+	return mesh;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <glm/glm.hpp>
+#include "MaterialTable.h"
+#include "ObjLoader.h"
+
+// An indexed triangle mesh with its vertex attributes kept in separate arrays, so that a pass over one attribute
+// (transforming every position, say) streams through just the memory it needs. A vertex is one distinct
+// combination of position, texture coordinate and normal from the obj file, shared by every triangle corner
+// that uses that combination.
+struct Mesh {
+	std::vector<float> positionX;
+	std::vector<float> positionY;
+	std::vector<float> positionZ;
+	std::vector<float> normalX;
+	std::vector<float> normalY;
+	std::vector<float> normalZ;
+	std::vector<float> textureU;
+	std::vector<float> textureV;
+	// three vertex indices per triangle
+	std::vector<uint32_t> indices;
+	// one material per triangle, as an index into whichever MaterialTable the mesh was built against
+	std::vector<MaterialIndex> materials;
+
+	size_t vertexCount() const { return positionX.size(); }
+	size_t triangleCount() const { return materials.size(); }
+	glm::vec3 position(uint32_t vertex) const { return {positionX[vertex], positionY[vertex], positionZ[vertex]}; }
+	glm::vec3 normal(uint32_t vertex) const { return {normalX[vertex], normalY[vertex], normalZ[vertex]}; }
+	glm::vec2 textureCoordinate(uint32_t vertex) const { return {textureU[vertex], textureV[vertex]}; }
+};
+
+// Called once per triangle with the obj material index (ObjTriangle::NO_INDEX for none) and whether all three
+// corners have texture coordinates, and returns the material to store for that triangle.
+typedef std::function<MaterialIndex(uint32_t objMaterial, bool hasTextureCoordinates)> MeshMaterialMapping;
+
+// Welds the corners of a loaded model into shared vertices, scaling every position by `scale`. Missing texture
+// coordinates and normals come out as zeros.
+Mesh buildMesh(const ObjModelView &model, float scale, const MeshMaterialMapping &materialFor);
@@ -0,0 +1,281 @@
+#include "MeshCache.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <system_error>
+
+namespace {
+	constexpr char MAGIC[8] = {'R', 'N', 'M', 'E', 'S', 'H', '\0', '\0'};
+	constexpr uint32_t FORMAT_VERSION = 1;
+	// written as a number and read back as one, so a cache from a machine with the other byte order won't match
+	constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+	constexpr uint64_t SECTION_ALIGNMENT = 64;
+
+	enum SectionType : uint32_t {
+		POSITIONS,
+		TEXTURE_COORDINATES,
+		NORMALS,
+		TRIANGLES,
+		MATERIALS,
+		SOURCE_STAMPS,
+		STRINGS,
+		ACCELERATION_STRUCTURE,
+		SECTION_COUNT
+	};
+
+	struct Section {
+		uint64_t offset;
+		uint64_t count;
+		uint32_t elementSize;
+		uint32_t padding;
+	};
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrderMark;
+		uint32_t accelerationStructureType;
+		uint32_t accelerationStructureVersion;
+		Section sections[SECTION_COUNT];
+	};
+
+	// a piece of text in the STRINGS section
+	struct StringReference {
+		uint32_t offset;
+		uint32_t length;
+	};
+
+	struct CachedMaterial {
+		float diffuse[3];
+		StringReference name;
+		StringReference diffuseTexture;
+	};
+
+	// what a source file looked like when the cache was written
+	struct SourceStamp {
+		uint64_t size;
+		int64_t modificationTime;
+		StringReference path;
+	};
+
+	bool stampFile(const std::string &path, uint64_t &size, int64_t &modificationTime) {
+		std::error_code error;
+		size = std::filesystem::file_size(path, error);
+		if (error) return false;
+		auto time = std::filesystem::last_write_time(path, error);
+		if (error) return false;
+		// only ever compared for equality, so the clock's epoch doesn't matter
+		modificationTime = int64_t(time.time_since_epoch().count());
+		return true;
+	}
+
+	template<typename T>
+	ArrayView<T> sectionView(const MappedFile &mapping, const Header &header, SectionType type) {
+		const Section &section = header.sections[type];
+		return ArrayView<T>(reinterpret_cast<const T *>(mapping.data() + section.offset), size_t(section.count));
+	}
+
+	struct Payload {
+		const void *data;
+		uint64_t count;
+		uint32_t elementSize;
+	};
+
+	// Lays the payloads out after the header, fills in its sections and writes the lot to finalPath by way of a
+	// temporary file
+	bool writeSections(const std::string &finalPath, Header &header, const Payload (&payloads)[SECTION_COUNT]) {
+		uint64_t offset = sizeof(Header);
+		for (uint32_t i = 0; i < SECTION_COUNT; i++) {
+			offset = (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+			header.sections[i] = {offset, payloads[i].count, payloads[i].elementSize, 0};
+			offset += payloads[i].count * payloads[i].elementSize;
+		}
+
+		std::string temporaryPath = finalPath + ".tmp";
+		{
+			std::ofstream output(temporaryPath, std::ofstream::binary | std::ofstream::trunc);
+			if (!output) return false;
+			output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			uint64_t written = sizeof(Header);
+			static const char zeros[SECTION_ALIGNMENT] = {};
+			for (uint32_t i = 0; i < SECTION_COUNT; i++) {
+				output.write(zeros, std::streamsize(header.sections[i].offset - written));
+				uint64_t bytes = payloads[i].count * payloads[i].elementSize;
+				if (bytes != 0) output.write(static_cast<const char *>(payloads[i].data), std::streamsize(bytes));
+				written = header.sections[i].offset + bytes;
+			}
+			if (!output) {
+				output.close();
+				std::remove(temporaryPath.c_str());
+				return false;
+			}
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temporaryPath, finalPath, error);
+		if (error) std::remove(temporaryPath.c_str());
+		return !error;
+	}
+
+	class StringTable {
+	public:
+		StringReference add(const std::string &text) {
+			StringReference reference = {uint32_t(characters.size()), uint32_t(text.size())};
+			characters.insert(characters.end(), text.begin(), text.end());
+			return reference;
+		}
+		const std::vector<char> &data() const { return characters; }
+	private:
+		std::vector<char> characters;
+	};
+}
+
+std::string MeshCache::pathFor(const std::string &sourceFilename) {
+	return sourceFilename + ".rnmesh";
+}
+
+bool MeshCache::write(const std::string &sourceFilename, const ObjModel &model,
+                      ArrayView<uint8_t> accelerationStructure, uint32_t accelerationStructureType, uint32_t accelerationStructureVersion) {
+	StringTable strings;
+
+	std::vector<SourceStamp> stamps;
+	std::vector<std::string> sources = {sourceFilename};
+	sources.insert(sources.end(), model.materialLibraries.begin(), model.materialLibraries.end());
+	for (const auto &source : sources) {
+		SourceStamp stamp {};
+		if (!stampFile(source, stamp.size, stamp.modificationTime)) return false;
+		stamp.path = strings.add(source);
+		stamps.push_back(stamp);
+	}
+
+	std::vector<CachedMaterial> materials;
+	for (const auto &material : model.materials) {
+		CachedMaterial cached {};
+		cached.diffuse[0] = material.diffuse.r;
+		cached.diffuse[1] = material.diffuse.g;
+		cached.diffuse[2] = material.diffuse.b;
+		cached.name = strings.add(material.name);
+		cached.diffuseTexture = strings.add(material.diffuseTexture);
+		materials.push_back(cached);
+	}
+
+	Payload payloads[SECTION_COUNT] = {
+			{model.positions.data(), model.positions.size(), sizeof(glm::vec3)},
+			{model.textureCoordinates.data(), model.textureCoordinates.size(), sizeof(glm::vec2)},
+			{model.normals.data(), model.normals.size(), sizeof(glm::vec3)},
+			{model.triangles.data(), model.triangles.size(), sizeof(ObjTriangle)},
+			{materials.data(), materials.size(), sizeof(CachedMaterial)},
+			{stamps.data(), stamps.size(), sizeof(SourceStamp)},
+			{strings.data().data(), strings.data().size(), 1},
+			{accelerationStructure.data(), accelerationStructure.size(), 1}
+	};
+
+	Header header {};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = FORMAT_VERSION;
+	header.byteOrderMark = BYTE_ORDER_MARK;
+	header.accelerationStructureType = accelerationStructureType;
+	header.accelerationStructureVersion = accelerationStructureVersion;
+	return writeSections(pathFor(sourceFilename), header, payloads);
+}
+
+bool MeshCache::rewrite(const std::string &sourceFilename, ArrayView<uint8_t> accelerationStructure, uint32_t accelerationStructureType, uint32_t accelerationStructureVersion) const {
+	if (!isOpen()) return false;
+	// open has checked every section, so they can be copied across as they are
+	Header header = *reinterpret_cast<const Header *>(file.data());
+	Payload payloads[SECTION_COUNT];
+	for (uint32_t i = 0; i < SECTION_COUNT; i++) {
+		const Section &section = header.sections[i];
+		payloads[i] = {file.data() + section.offset, section.count, section.elementSize};
+	}
+	payloads[ACCELERATION_STRUCTURE] = {accelerationStructure.data(), accelerationStructure.size(), 1};
+	header.accelerationStructureType = accelerationStructureType;
+	header.accelerationStructureVersion = accelerationStructureVersion;
+	return writeSections(pathFor(sourceFilename), header, payloads);
+}
+
+bool MeshCache::open(const std::string &sourceFilename) {
+	*this = MeshCache();
+	MappedFile mapping;
+	try {
+		mapping = MappedFile(pathFor(sourceFilename));
+	} catch (const std::runtime_error &) {
+		return false;
+	}
+	if (mapping.size() < sizeof(Header)) return false;
+
+	const Header &header = *reinterpret_cast<const Header *>(mapping.data());
+	if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != FORMAT_VERSION || header.byteOrderMark != BYTE_ORDER_MARK) return false;
+
+	const uint32_t expectedSizes[SECTION_COUNT] = {
+			sizeof(glm::vec3), sizeof(glm::vec2), sizeof(glm::vec3), sizeof(ObjTriangle),
+			sizeof(CachedMaterial), sizeof(SourceStamp), 1, 1
+	};
+	for (uint32_t i = 0; i < SECTION_COUNT; i++) {
+		const Section &section = header.sections[i];
+		if (section.elementSize != expectedSizes[i] || section.offset % SECTION_ALIGNMENT != 0) return false;
+		if (section.offset > mapping.size() || section.count > (mapping.size() - section.offset) / section.elementSize) return false;
+	}
+
+	ArrayView<char> strings = sectionView<char>(mapping, header, STRINGS);
+	auto text = [&](const StringReference &reference, std::string &result) {
+		if (uint64_t(reference.offset) + reference.length > strings.size()) return false;
+		result.assign(strings.data() + reference.offset, reference.length);
+		return true;
+	};
+
+	std::string path;
+	for (const SourceStamp &stamp : sectionView<SourceStamp>(mapping, header, SOURCE_STAMPS)) {
+		uint64_t size;
+		int64_t modificationTime;
+		if (!text(stamp.path, path) || !stampFile(path, size, modificationTime)) return false;
+		if (size != stamp.size || modificationTime != stamp.modificationTime) return false;
+	}
+
+	for (const CachedMaterial &cached : sectionView<CachedMaterial>(mapping, header, MATERIALS)) {
+		ObjMaterial material;
+		material.diffuse = glm::vec3(cached.diffuse[0], cached.diffuse[1], cached.diffuse[2]);
+		if (!text(cached.name, material.name) || !text(cached.diffuseTexture, material.diffuseTexture)) return false;
+		materials.push_back(material);
+	}
+
+	model.positions = sectionView<glm::vec3>(mapping, header, POSITIONS);
+	model.textureCoordinates = sectionView<glm::vec2>(mapping, header, TEXTURE_COORDINATES);
+	model.normals = sectionView<glm::vec3>(mapping, header, NORMALS);
+	model.triangles = sectionView<ObjTriangle>(mapping, header, TRIANGLES);
+	model.materials = materials;
+
+	// a damaged (or hand edited) cache mustn't be able to send anyone reading the model out of bounds
+	auto inRange = [](uint32_t index, size_t count, bool optional) {
+		return index < count || (optional && index == ObjTriangle::NO_INDEX);
+	};
+	for (const ObjTriangle &triangle : model.triangles) {
+		bool valid = inRange(triangle.material, materials.size(), true);
+		for (int i = 0; i < 3; i++) {
+			valid = valid && inRange(triangle.positions[i], model.positions.size(), false);
+			valid = valid && inRange(triangle.textureCoordinates[i], model.textureCoordinates.size(), true);
+			valid = valid && inRange(triangle.normals[i], model.normals.size(), true);
+		}
+		if (!valid) {
+			*this = MeshCache();
+			return false;
+		}
+	}
+
+	acceleration = sectionView<uint8_t>(mapping, header, ACCELERATION_STRUCTURE);
+	accelerationType = header.accelerationStructureType;
+	accelerationVersion = header.accelerationStructureVersion;
+	// the views point into the mapping's pages, which stay where they are when the mapping object is moved
+	file = std::move(mapping);
+	return true;
+}
+
+ObjModelView MeshCache::view() const {
+	return model;
+}
+
+ArrayView<uint8_t> MeshCache::accelerationStructure(uint32_t type, uint32_t version) const {
+	if (acceleration.empty() || type != accelerationType || version != accelerationVersion) return {};
+	return acceleration;
+}
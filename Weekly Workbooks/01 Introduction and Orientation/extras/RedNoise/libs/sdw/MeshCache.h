@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "ArrayView.h"
+#include "MappedFile.h"
+#include "ObjLoader.h"
+
+// Binary copy of a parsed obj model, written next to the obj file (as <file>.rnmesh) so that later runs can map
+// it instead of parsing text. The arrays are stored exactly as they are laid out in memory, each aligned to 64
+// bytes, so opening a cache only maps it and hands out views into the mapping.
+//
+// A cache remembers the size and modification time of the obj file and every mtl file it used, and is ignored
+// if any of them has changed. It is also ignored if it was written by a build with a different version of the
+// format or different sizes for the stored structures, which covers most ways a stale binary could be misread.
+//
+// Besides the model, a cache can hold one opaque blob for a prebuilt acceleration structure, tagged with a
+// caller-chosen type and version so that an out of date layout can be told apart and rebuilt.
+class MeshCache {
+public:
+	MeshCache() = default;
+
+	// Maps the cache for sourceFilename. Returns false, leaving the cache closed, if there is no cache, it is out
+	// of date or it is damaged.
+	bool open(const std::string &sourceFilename);
+	bool isOpen() const { return file.size() != 0; }
+	// The model's arrays, pointing into the mapping. Only valid while the cache stays open.
+	ObjModelView view() const;
+	// The acceleration structure stored with the model, or an empty view if there is none of this type and version
+	ArrayView<uint8_t> accelerationStructure(uint32_t type, uint32_t version) const;
+
+	// Writes the cache for sourceFilename, replacing any cache that is there. The file is written under a
+	// temporary name and renamed into place, so a run that opens it at the same time sees the old or the new
+	// cache but never half of one. Returns false if it can't be written.
+	static bool write(const std::string &sourceFilename, const ObjModel &model,
+	                  ArrayView<uint8_t> accelerationStructure = {}, uint32_t accelerationStructureType = 0, uint32_t accelerationStructureVersion = 0);
+	// Writes this open cache out again in the same way, with the model and source files it was checked against
+	// but a different acceleration structure, for when the one it has is of the wrong type or version. The views
+	// it handed out stay valid, since the old file stays mapped.
+	bool rewrite(const std::string &sourceFilename, ArrayView<uint8_t> accelerationStructure, uint32_t accelerationStructureType, uint32_t accelerationStructureVersion) const;
+	static std::string pathFor(const std::string &sourceFilename);
+
+private:
+	MappedFile file;
+	ObjModelView model;
+	// materials have variable length names, so they are stored as fixed records plus a string table and
+	// rebuilt here when the cache is opened
+	std::vector<ObjMaterial> materials;
+	ArrayView<uint8_t> acceleration;
+	uint32_t accelerationType = 0;
+	uint32_t accelerationVersion = 0;
+};
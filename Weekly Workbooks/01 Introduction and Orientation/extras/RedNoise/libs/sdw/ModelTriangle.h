@@ -6,10 +6,14 @@
 #include "Colour.h"
 #include "TexturePoint.h"
 
+class TextureMap;
+
 struct ModelTriangle {
 	std::array<glm::vec3, 3> vertices{};
 	std::array<TexturePoint, 3> texturePoints{};
 	Colour colour{};
+	// texture to sample with texturePoints, or null for a flat coloured triangle
+	const TextureMap *texture{};
 	glm::vec3 normal{};
 
 	ModelTriangle();
@@ -0,0 +1,418 @@
+#include "ObjLoader.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+
+namespace {
+	bool isSpace(char c) {
+		return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+	}
+
+	std::string_view trim(std::string_view text) {
+		while (!text.empty() && isSpace(text.front())) text.remove_prefix(1);
+		while (!text.empty() && isSpace(text.back())) text.remove_suffix(1);
+		return text;
+	}
+
+	// Hands out the whitespace separated tokens of one line as views into the mapped file
+	struct Tokenizer {
+		std::string_view rest;
+
+		std::string_view next() {
+			size_t start = 0;
+			while (start < rest.size() && isSpace(rest[start])) start++;
+			size_t end = start;
+			while (end < rest.size() && !isSpace(rest[end])) end++;
+			std::string_view token = rest.substr(start, end - start);
+			rest.remove_prefix(end);
+			return token;
+		}
+
+		// everything left on the line, for names that may contain spaces
+		std::string_view remainder() {
+			return trim(rest);
+		}
+	};
+
+	// Calls lineBody(line, lineNumber) for every line of the text, with comments stripped, and returns the number
+	// of lines
+	template<typename LineBody>
+	size_t forEachLine(std::string_view text, LineBody lineBody) {
+		size_t lineNumber = 0;
+		while (!text.empty()) {
+			lineNumber++;
+			const char *newline = static_cast<const char *>(std::memchr(text.data(), '\n', text.size()));
+			size_t lineLength = newline != nullptr ? size_t(newline - text.data()) : text.size();
+			std::string_view line = text.substr(0, lineLength);
+			text.remove_prefix(std::min(lineLength + 1, text.size()));
+
+			size_t comment = line.find('#');
+			if (comment != std::string_view::npos) line = line.substr(0, comment);
+			lineBody(line, lineNumber);
+		}
+		return lineNumber;
+	}
+
+	[[noreturn]] void throwParseError(const std::string &filename, size_t lineNumber, const std::string &message) {
+		throw std::invalid_argument(filename + ":" + std::to_string(lineNumber) + ": " + message);
+	}
+
+	bool parseFloat(std::string_view token, float &value) {
+		if (!token.empty() && token.front() == '+') token.remove_prefix(1);
+		if (token.empty()) return false;
+#if defined(__cpp_lib_to_chars)
+		auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+		return result.ec == std::errc() && result.ptr == token.data() + token.size();
+#else
+		// standard libraries without floating point from_chars: strtof needs a terminated string, so copy the
+		// token into a stack buffer first (no number worth parsing is anywhere near this long)
+		char buffer[64];
+		if (token.size() >= sizeof(buffer)) return false;
+		std::memcpy(buffer, token.data(), token.size());
+		buffer[token.size()] = '\0';
+		char *end = nullptr;
+		value = std::strtof(buffer, &end);
+		return end == buffer + token.size();
+#endif
+	}
+
+	bool parseInteger(std::string_view token, long &value) {
+		if (token.empty()) return false;
+		auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+		return result.ec == std::errc() && result.ptr == token.data() + token.size();
+	}
+
+	template<int Count>
+	bool parseFloats(Tokenizer &tokens, float *values) {
+		for (int i = 0; i < Count; i++) {
+			if (!parseFloat(tokens.next(), values[i])) return false;
+		}
+		return true;
+	}
+
+	// An index as it was written in one chunk of the file. Positive obj indices are absolute (and start at 1),
+	// but negative ones count back from the most recent element, which a chunk can't know until every chunk
+	// before it has been parsed. Those are stored relative to the start of the chunk and rebased afterwards.
+	struct ChunkIndex {
+		int32_t value;
+		bool relative;
+	};
+
+	// marks a texture coordinate or normal that a face corner leaves out
+	constexpr ChunkIndex NO_CHUNK_INDEX = {INT32_MIN, false};
+
+	bool parseIndex(std::string_view token, size_t localCount, ChunkIndex &index) {
+		long value;
+		if (!parseInteger(token, value) || value == 0) return false;
+		int64_t stored = value > 0 ? int64_t(value) - 1 : int64_t(localCount) + value;
+		if (stored <= INT32_MIN || stored > INT32_MAX) return false;
+		index = {int32_t(stored), value < 0};
+		return true;
+	}
+
+	// a triangle's nine indices, packed to keep the intermediate arrays of a big file small: positions, then
+	// texture coordinates, then normals, with bit i of relativeMask set when indices[i] is relative
+	struct ChunkTriangle {
+		std::array<int32_t, 9> indices;
+		uint16_t relativeMask;
+
+		void set(int slot, const ChunkIndex &index) {
+			indices[slot] = index.value;
+			if (index.relative) relativeMask |= uint16_t(1 << slot);
+		}
+	};
+
+	struct FaceCorner {
+		ChunkIndex position;
+		ChunkIndex textureCoordinate;
+		ChunkIndex normal;
+	};
+
+	// a usemtl or mtllib line, kept in file order because both change how later usemtl names map to materials
+	struct MaterialEvent {
+		bool isLibrary;
+		std::string name;
+		// the chunk's triangles from this one on use the material (for usemtl)
+		size_t firstTriangle;
+	};
+
+	struct ObjChunk {
+		std::string_view text;
+		std::vector<glm::vec3> positions;
+		std::vector<glm::vec2> textureCoordinates;
+		std::vector<glm::vec3> normals;
+		std::vector<ChunkTriangle> triangles;
+		std::vector<MaterialEvent> materialEvents;
+		size_t lineCount = 0;
+		// the first problem found in the chunk, with its line number counted from the start of the chunk
+		std::string error;
+		size_t errorLine = 0;
+		// reused for every face, so it only allocates until it has seen the biggest polygon in the chunk
+		std::vector<FaceCorner> corners;
+	};
+
+	const char *parseFace(Tokenizer &tokens, ObjChunk &chunk) {
+		chunk.corners.clear();
+		for (std::string_view token = tokens.next(); !token.empty(); token = tokens.next()) {
+			FaceCorner corner = {NO_CHUNK_INDEX, NO_CHUNK_INDEX, NO_CHUNK_INDEX};
+			size_t firstSlash = token.find('/');
+			size_t secondSlash = firstSlash == std::string_view::npos ? std::string_view::npos : token.find('/', firstSlash + 1);
+
+			if (!parseIndex(token.substr(0, firstSlash), chunk.positions.size(), corner.position)) return "bad vertex index in face";
+			if (firstSlash != std::string_view::npos) {
+				std::string_view textureToken = token.substr(firstSlash + 1, secondSlash == std::string_view::npos ? std::string_view::npos : secondSlash - firstSlash - 1);
+				// "v//vn", and the "v/" that the cornell box files use, have no texture coordinate
+				if (!textureToken.empty() && !parseIndex(textureToken, chunk.textureCoordinates.size(), corner.textureCoordinate))
+					return "bad texture coordinate index in face";
+			}
+			if (secondSlash != std::string_view::npos) {
+				std::string_view normalToken = token.substr(secondSlash + 1);
+				if (!normalToken.empty() && !parseIndex(normalToken, chunk.normals.size(), corner.normal)) return "bad normal index in face";
+			}
+			chunk.corners.push_back(corner);
+		}
+		if (chunk.corners.size() < 3) return "face with fewer than three corners";
+
+		for (size_t i = 1; i + 1 < chunk.corners.size(); i++) {
+			const FaceCorner *fan[3] = {&chunk.corners[0], &chunk.corners[i], &chunk.corners[i + 1]};
+			ChunkTriangle triangle;
+			triangle.relativeMask = 0;
+			for (int j = 0; j < 3; j++) {
+				triangle.set(j, fan[j]->position);
+				triangle.set(3 + j, fan[j]->textureCoordinate);
+				triangle.set(6 + j, fan[j]->normal);
+			}
+			chunk.triangles.push_back(triangle);
+		}
+		return nullptr;
+	}
+
+	const char *parseLine(std::string_view line, ObjChunk &chunk) {
+		Tokenizer tokens{line};
+		std::string_view keyword = tokens.next();
+		if (keyword.empty()) return nullptr;
+
+		if (keyword == "v") {
+			float values[3];
+			if (!parseFloats<3>(tokens, values)) return "malformed vertex";
+			chunk.positions.emplace_back(values[0], values[1], values[2]);
+
+		} else if (keyword == "vt") {
+			float values[2];
+			if (!parseFloats<2>(tokens, values)) return "malformed texture coordinate";
+			chunk.textureCoordinates.emplace_back(values[0], values[1]);
+
+		} else if (keyword == "vn") {
+			float values[3];
+			if (!parseFloats<3>(tokens, values)) return "malformed normal";
+			chunk.normals.emplace_back(values[0], values[1], values[2]);
+
+		} else if (keyword == "f") {
+			return parseFace(tokens, chunk);
+
+		} else if (keyword == "usemtl" || keyword == "mtllib") {
+			chunk.materialEvents.push_back({keyword == "mtllib", std::string(tokens.remainder()), chunk.triangles.size()});
+		}
+		return nullptr;
+	}
+
+	void parseChunk(ObjChunk &chunk) {
+		chunk.lineCount = forEachLine(chunk.text, [&chunk](std::string_view line, size_t lineNumber) {
+			if (!chunk.error.empty()) return;
+			const char *error = parseLine(line, chunk);
+			if (error != nullptr) {
+				chunk.error = error;
+				chunk.errorLine = lineNumber;
+			}
+		});
+	}
+
+	// chunks smaller than this aren't worth handing to another thread
+	constexpr size_t MIN_CHUNK_BYTES = 1 << 20;
+	// a few chunks per thread evens out chunks that turn out to be slower to parse than others
+	constexpr size_t CHUNKS_PER_THREAD = 4;
+
+	// splits the file into chunks of roughly equal size that each start at the beginning of a line
+	std::vector<ObjChunk> splitIntoChunks(std::string_view text, size_t threadCount) {
+		size_t chunkCount = std::max<size_t>(1, std::min(text.size() / MIN_CHUNK_BYTES, threadCount * CHUNKS_PER_THREAD));
+		std::vector<ObjChunk> chunks(chunkCount);
+		size_t start = 0;
+		for (size_t i = 0; i < chunkCount; i++) {
+			size_t end = text.size();
+			if (i + 1 < chunkCount) {
+				end = std::max(start, text.size() / chunkCount * (i + 1));
+				size_t newline = text.find('\n', end);
+				end = newline == std::string_view::npos ? text.size() : newline + 1;
+			}
+			chunks[i].text = text.substr(start, end - start);
+			start = end;
+		}
+		return chunks;
+	}
+
+	// turns one of a chunk triangle's indices into an index into the whole model, clearing valid if it doesn't
+	// point at an element
+	uint32_t rebaseIndex(const ChunkTriangle &triangle, int slot, size_t chunkBase, size_t totalCount, bool &valid) {
+		bool relative = (triangle.relativeMask >> slot) & 1;
+		if (!relative && triangle.indices[slot] == NO_CHUNK_INDEX.value) return ObjTriangle::NO_INDEX;
+		int64_t absolute = relative ? int64_t(chunkBase) + triangle.indices[slot] : triangle.indices[slot];
+		if (absolute < 0 || absolute >= int64_t(totalCount)) {
+			valid = false;
+			return ObjTriangle::NO_INDEX;
+		}
+		return uint32_t(absolute);
+	}
+}
+
+ObjModel loadObjFile(const std::string &filename, ThreadPool *pool) {
+	MappedFile file(filename);
+	std::vector<ObjChunk> chunks = splitIntoChunks(file.view(), pool != nullptr ? pool->size() : 1);
+	auto forEachChunk = [&](const std::function<void(size_t)> &body) {
+		if (pool != nullptr) pool->parallelFor(chunks.size(), body);
+		else for (size_t i = 0; i < chunks.size(); i++) body(i);
+	};
+
+	forEachChunk([&](size_t i) { parseChunk(chunks[i]); });
+
+	// where each chunk's elements start in the model, which is also what its relative indices are relative to
+	std::vector<size_t> positionBases(chunks.size()), textureCoordinateBases(chunks.size()), normalBases(chunks.size()), triangleBases(chunks.size());
+	size_t positionCount = 0, textureCoordinateCount = 0, normalCount = 0, triangleCount = 0, lineCount = 0;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		const ObjChunk &chunk = chunks[i];
+		if (!chunk.error.empty()) throwParseError(filename, lineCount + chunk.errorLine, chunk.error);
+		lineCount += chunk.lineCount;
+		positionBases[i] = positionCount;
+		textureCoordinateBases[i] = textureCoordinateCount;
+		normalBases[i] = normalCount;
+		triangleBases[i] = triangleCount;
+		positionCount += chunk.positions.size();
+		textureCoordinateCount += chunk.textureCoordinates.size();
+		normalCount += chunk.normals.size();
+		triangleCount += chunk.triangles.size();
+	}
+
+	// material state runs from one chunk into the next, so it is worked out serially, in file order: each chunk
+	// gets a list of (first triangle, material) runs, starting with whatever material the chunk before ended on
+	ObjModel model;
+	std::unordered_map<std::string, uint32_t> materialIndices;
+	auto materialIndex = [&](const std::string &name) {
+		auto inserted = materialIndices.emplace(name, uint32_t(model.materials.size()));
+		if (inserted.second) {
+			model.materials.emplace_back();
+			model.materials.back().name = name;
+		}
+		return inserted.first->second;
+	};
+	std::vector<std::vector<std::pair<size_t, uint32_t>>> materialRuns(chunks.size());
+	uint32_t currentMaterial = ObjTriangle::NO_INDEX;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		materialRuns[i].emplace_back(0, currentMaterial);
+		for (const auto &event : chunks[i].materialEvents) {
+			if (event.isLibrary) {
+				model.materialLibraries.push_back(siblingPath(filename, event.name));
+				loadMtlFile(model.materialLibraries.back(), model.materials);
+				for (uint32_t j = 0; j < model.materials.size(); j++) materialIndices.emplace(model.materials[j].name, j);
+			} else {
+				currentMaterial = materialIndex(event.name);
+				materialRuns[i].emplace_back(event.firstTriangle, currentMaterial);
+			}
+		}
+	}
+
+	// with a single chunk (any small file, or no pool) the vertex arrays are already in place
+	bool singleChunk = chunks.size() == 1;
+	if (singleChunk) {
+		model.positions = std::move(chunks[0].positions);
+		model.textureCoordinates = std::move(chunks[0].textureCoordinates);
+		model.normals = std::move(chunks[0].normals);
+	} else {
+		model.positions.resize(positionCount);
+		model.textureCoordinates.resize(textureCoordinateCount);
+		model.normals.resize(normalCount);
+	}
+	model.triangles.resize(triangleCount);
+	std::vector<char> chunkIndicesValid(chunks.size(), 1);
+
+	forEachChunk([&](size_t i) {
+		ObjChunk &chunk = chunks[i];
+		if (!singleChunk) {
+			std::copy(chunk.positions.begin(), chunk.positions.end(), model.positions.begin() + positionBases[i]);
+			std::copy(chunk.textureCoordinates.begin(), chunk.textureCoordinates.end(), model.textureCoordinates.begin() + textureCoordinateBases[i]);
+			std::copy(chunk.normals.begin(), chunk.normals.end(), model.normals.begin() + normalBases[i]);
+		}
+
+		bool valid = true;
+		size_t run = 0;
+		for (size_t t = 0; t < chunk.triangles.size(); t++) {
+			while (run + 1 < materialRuns[i].size() && materialRuns[i][run + 1].first <= t) run++;
+			const ChunkTriangle &source = chunk.triangles[t];
+			ObjTriangle &triangle = model.triangles[triangleBases[i] + t];
+			for (int j = 0; j < 3; j++) {
+				triangle.positions[j] = rebaseIndex(source, j, positionBases[i], positionCount, valid);
+				triangle.textureCoordinates[j] = rebaseIndex(source, 3 + j, textureCoordinateBases[i], textureCoordinateCount, valid);
+				triangle.normals[j] = rebaseIndex(source, 6 + j, normalBases[i], normalCount, valid);
+			}
+			triangle.material = materialRuns[i][run].second;
+		}
+		chunkIndicesValid[i] = valid;
+		// the chunk's copy isn't needed any more, and for big files it is worth giving the memory back early
+		chunk = ObjChunk();
+	});
+
+	for (char valid : chunkIndicesValid) {
+		if (!valid) throw std::invalid_argument(filename + ": face refers to a vertex, texture coordinate or normal that doesn't exist");
+	}
+	return model;
+}
+
+void loadMtlFile(const std::string &filename, std::vector<ObjMaterial> &materials) {
+	MappedFile file(filename);
+	ObjMaterial *current = nullptr;
+
+	forEachLine(file.view(), [&](std::string_view line, size_t lineNumber) {
+		Tokenizer tokens{line};
+		std::string_view keyword = tokens.next();
+
+		if (keyword == "newmtl") {
+			std::string_view name = tokens.remainder();
+			current = nullptr;
+			for (auto & material : materials) {
+				if (material.name == name) current = &material;
+			}
+			if (current == nullptr) {
+				materials.emplace_back();
+				current = &materials.back();
+				current->name = std::string(name);
+			}
+
+		} else if (keyword == "Kd") {
+			float values[3];
+			if (current == nullptr || !parseFloats<3>(tokens, values)) throwParseError(filename, lineNumber, "malformed Kd");
+			current->diffuse = glm::vec3(values[0], values[1], values[2]);
+
+		} else if (keyword == "map_Kd") {
+			if (current == nullptr) throwParseError(filename, lineNumber, "map_Kd outside of a material");
+			// any options (-s, -o, ...) come first, so the file name is the last token
+			std::string_view textureName;
+			for (std::string_view token = tokens.next(); !token.empty(); token = tokens.next()) textureName = token;
+			current->diffuseTexture = siblingPath(filename, std::string(textureName));
+		}
+	});
+}
+
+ObjModelView viewOf(const ObjModel &model) {
+	return {model.positions, model.textureCoordinates, model.normals, model.triangles, model.materials};
+}
+
+std::string siblingPath(const std::string &filename, const std::string &siblingName) {
+	size_t lastSeparator = filename.find_last_of("/\\");
+	if (lastSeparator == std::string::npos) return siblingName;
+	return filename.substr(0, lastSeparator + 1) + siblingName;
+}
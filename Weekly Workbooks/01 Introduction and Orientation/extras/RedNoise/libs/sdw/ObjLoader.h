@@ -0,0 +1,63 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "ArrayView.h"
+
+class ThreadPool;
+
+struct ObjMaterial {
+	std::string name;
+	glm::vec3 diffuse{};
+	// path of the map_Kd texture (already resolved against the mtl file's directory), or empty for none
+	std::string diffuseTexture;
+};
+
+// One triangle of an obj face; faces with more than three corners are split into a fan. Indices are zero based,
+// with relative (negative) indices already resolved, and NO_INDEX marks a missing texture coordinate or normal,
+// or a face that came before any usemtl.
+struct ObjTriangle {
+	static constexpr uint32_t NO_INDEX = UINT32_MAX;
+
+	std::array<uint32_t, 3> positions;
+	std::array<uint32_t, 3> textureCoordinates;
+	std::array<uint32_t, 3> normals;
+	uint32_t material;
+};
+
+struct ObjModel {
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec2> textureCoordinates;
+	std::vector<glm::vec3> normals;
+	std::vector<ObjTriangle> triangles;
+	std::vector<ObjMaterial> materials;
+	// every mtl file the model pulled materials from, resolved against the obj file's directory
+	std::vector<std::string> materialLibraries;
+};
+
+// The arrays of a loaded model, wherever they are stored: in an ObjModel, or in a mapped MeshCache
+struct ObjModelView {
+	ArrayView<glm::vec3> positions;
+	ArrayView<glm::vec2> textureCoordinates;
+	ArrayView<glm::vec3> normals;
+	ArrayView<ObjTriangle> triangles;
+	ArrayView<ObjMaterial> materials;
+};
+
+ObjModelView viewOf(const ObjModel &model);
+
+// Parses an obj file (and every mtl file it names) straight out of a memory mapping. Understands v, vt, vn,
+// f (in all four v, v/vt, v//vn and v/vt/vn forms), usemtl and mtllib, and skips everything else. Malformed
+// lines throw std::invalid_argument naming the file and line.
+// Given a pool, big files are split into line aligned chunks that are parsed in parallel and then stitched
+// back together in file order, so the result is the same as parsing on one thread. Face indices are checked
+// against the whole file, so (unlike a strictly serial reader) a face may refer to a vertex that comes after it.
+ObjModel loadObjFile(const std::string &filename, ThreadPool *pool = nullptr);
+// Reads newmtl, Kd and map_Kd from an mtl file. Materials that are already in the list (because a usemtl named
+// them first) are filled in rather than added again.
+void loadMtlFile(const std::string &filename, std::vector<ObjMaterial> &materials);
+// obj and mtl files name the files they refer to relative to their own directory
+std::string siblingPath(const std::string &filename, const std::string &siblingName);
@@ -0,0 +1,5 @@
+#include "OffscreenTarget.h"
+
+OffscreenTarget::OffscreenTarget(size_t w, size_t h) : RenderTarget(w, h), pixelBuffer(stride * h, 0) {
+	pixels = pixelBuffer.data();
+}
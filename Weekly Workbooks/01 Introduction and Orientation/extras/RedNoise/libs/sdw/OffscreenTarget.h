@@ -0,0 +1,12 @@
+#pragma once
+
+#include "RenderTarget.h"
+
+// A render target that is just a buffer in memory, for rendering without a display (and without touching SDL)
+class OffscreenTarget : public RenderTarget {
+public:
+	OffscreenTarget(size_t w, size_t h);
+
+private:
+	PixelBuffer pixelBuffer;
+};
@@ -0,0 +1,75 @@
+#include "PpmFile.h"
+#include <cctype>
+#include <stdexcept>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+namespace {
+
+// Reads the next whitespace separated header token, skipping comments (a '#' up to the end of its line)
+std::string nextToken(const std::string &filename, const char *&cursor, const char *end) {
+	while (cursor < end) {
+		if (*cursor == '#') {
+			while (cursor < end && *cursor != '\n') cursor++;
+		} else if (std::isspace(static_cast<unsigned char>(*cursor))) {
+			cursor++;
+		} else break;
+	}
+	const char *start = cursor;
+	while (cursor < end && !std::isspace(static_cast<unsigned char>(*cursor)) && *cursor != '#') cursor++;
+	if (cursor == start) throw std::invalid_argument("`" + filename + "` ends in the middle of its PPM header");
+	return std::string(start, cursor);
+}
+
+size_t parseDimension(const std::string &filename, const std::string &token) {
+	size_t value = 0;
+	for (char c : token) {
+		if (!std::isdigit(static_cast<unsigned char>(c)) || value > (SIZE_MAX - 9) / 10) {
+			throw std::invalid_argument("Failed to parse `" + token + "` in the header of `" + filename + "`");
+		}
+		value = value * 10 + size_t(c - '0');
+	}
+	return value;
+}
+
+}
+
+PpmFile::PpmFile(const std::string &filename) : file(filename) {
+	const char *cursor = file.data();
+	const char *end = cursor + file.size();
+	if (nextToken(filename, cursor, end) != "P6") throw std::invalid_argument("`" + filename + "` isn't a binary (P6) PPM file");
+	imageWidth = parseDimension(filename, nextToken(filename, cursor, end));
+	imageHeight = parseDimension(filename, nextToken(filename, cursor, end));
+	std::string maximum = nextToken(filename, cursor, end);
+	if (maximum != "255") throw std::invalid_argument("`" + filename + "` has a maximum value of " + maximum + " (only 255 is supported)");
+	if (imageWidth == 0 || imageHeight == 0) throw std::invalid_argument("`" + filename + "` has no pixels");
+	// exactly one whitespace character separates the header from the payload
+	cursor++;
+
+	size_t available = cursor < end ? size_t(end - cursor) : 0;
+	if (imageHeight > available / 3 / imageWidth) throw std::invalid_argument("`" + filename + "` is shorter than its header says");
+	payload = reinterpret_cast<const uint8_t *>(cursor);
+}
+
+void PpmFile::convertRow(size_t y, uint32_t *argb) const {
+	unpackRgb(rgbRow(y), imageWidth, argb);
+}
+
+// The SSSE3 loop spreads four triples out to four pixels per shuffle. Each load takes 16 bytes to use 12 of them,
+// so the vector loop stops while at least 16 bytes are left and the scalar loop finishes the rest.
+void unpackRgb(const uint8_t *source, size_t count, uint32_t *destination) {
+	size_t x = 0;
+#if defined(__SSSE3__)
+	const __m128i toArgb = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	const __m128i opaque = _mm_set1_epi32(int(0xFF000000u));
+	for (; x + 6 <= count; x += 4) {
+		__m128i rgb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 3 * x));
+		__m128i argb = _mm_or_si128(_mm_shuffle_epi8(rgb, toArgb), opaque);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(destination + x), argb);
+	}
+#endif
+	for (; x < count; x++) {
+		destination[x] = 0xFF000000u | (uint32_t(source[3 * x]) << 16) | (uint32_t(source[3 * x + 1]) << 8) | source[3 * x + 2];
+	}
+}
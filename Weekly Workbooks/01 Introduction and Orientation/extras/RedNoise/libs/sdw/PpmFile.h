@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "MappedFile.h"
+
+// A binary (P6) PPM file mapped into memory with its header parsed. The RGB payload is read straight out of the
+// mapping: rgb() and rgbRow() borrow it as it is, for callers happy with three bytes per pixel, and convertRow()
+// turns a row into 0xAARRGGBB pixels for callers that aren't. Only 8 bit files (a maximum value of 255) are
+// supported. Throws std::runtime_error if the file can't be mapped and std::invalid_argument if it isn't a
+// well formed P6 file.
+class PpmFile {
+public:
+	explicit PpmFile(const std::string &filename);
+
+	size_t width() const { return imageWidth; }
+	size_t height() const { return imageHeight; }
+	// width * height R, G, B triples, row by row from the top; only valid while this PpmFile is
+	const uint8_t *rgb() const { return payload; }
+	const uint8_t *rgbRow(size_t y) const { return payload + y * imageWidth * 3; }
+	// Writes row y as width() opaque 0xAARRGGBB pixels
+	void convertRow(size_t y, uint32_t *argb) const;
+
+private:
+	MappedFile file;
+	size_t imageWidth = 0;
+	size_t imageHeight = 0;
+	const uint8_t *payload = nullptr;
+};
+
+// Unpacks count R, G, B triples into opaque 0xAARRGGBB pixels. Never reads past source + 3 * count.
+void unpackRgb(const uint8_t *source, size_t count, uint32_t *destination);
@@ -1,5 +1,7 @@
 #include "RayTriangleIntersection.h"
 
+constexpr size_t RayTriangleIntersection::NO_TRIANGLE;
+
 RayTriangleIntersection::RayTriangleIntersection() = default;
 RayTriangleIntersection::RayTriangleIntersection(const glm::vec3 &point, float distance, const ModelTriangle &triangle, size_t index) :
 		intersectionPoint(point),
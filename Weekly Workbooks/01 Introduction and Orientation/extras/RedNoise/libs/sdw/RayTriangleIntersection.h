@@ -1,10 +1,14 @@
 #pragma once
 
+#include <cstdint>
 #include <glm/glm.hpp>
 #include <iostream>
 #include "ModelTriangle.h"
 
 struct RayTriangleIntersection {
+	// triangleIndex of a ray that didn't hit anything (whose distanceFromCamera is infinite)
+	static constexpr size_t NO_TRIANGLE = SIZE_MAX;
+
 	glm::vec3 intersectionPoint;
 	float distanceFromCamera;
 	ModelTriangle intersectedTriangle;
@@ -0,0 +1,47 @@
+#include "RenderTarget.h"
+
+RenderTarget::RenderTarget(size_t w, size_t h) : width(w), height(h), stride(paddedStride(w)), depthBuffer(w, h) {}
+
+void RenderTarget::savePPM(const std::string &filename) const {
+	writePPM(filename, pixels, width, height, stride);
+}
+
+void RenderTarget::saveBMP(const std::string &filename) const {
+	writeBMP(filename, pixels, width, height, stride);
+}
+
+void RenderTarget::save(const std::string &filename) const {
+	writeImage(filename, pixels, width, height, stride);
+}
+
+std::shared_ptr<const Image> RenderTarget::snapshot() const {
+	auto image = std::make_shared<Image>();
+	image->width = width;
+	image->height = height;
+	image->pixels.resize(width * height);
+	for (size_t y = 0; y < height; y++) std::copy_n(row(y), width, image->pixels.data() + y * width);
+	return image;
+}
+
+// Printing every miss used to turn a frame with triangles hanging off the screen into thousands of console
+// flushes, so misses are just counted (in debug builds) and can be inspected with outOfRangeAccesses
+void RenderTarget::setPixelColour(size_t x, size_t y, uint32_t colour) {
+	if ((x >= width) || (y >= height)) {
+#ifndef NDEBUG
+		outOfRangeCount.fetch_add(1, std::memory_order_relaxed);
+#endif
+	} else pixels[(y * stride) + x] = colour;
+}
+
+uint32_t RenderTarget::getPixelColour(size_t x, size_t y) {
+	if ((x >= width) || (y >= height)) {
+#ifndef NDEBUG
+		outOfRangeCount.fetch_add(1, std::memory_order_relaxed);
+#endif
+		return -1;
+	} else return pixels[(y * stride) + x];
+}
+
+void RenderTarget::clearPixels() {
+	std::fill_n(pixels, stride * height, 0);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "AlignedAllocator.h"
+#include "DepthBuffer.h"
+#include "ImageWriter.h"
+#include "Simd.h"
+
+typedef std::vector<uint32_t, AlignedAllocator<uint32_t, 64>> PixelBuffer;
+
+// Something to draw into: a width x height grid of 0xAARRGGBB pixels plus a depth buffer of the same size. Where
+// the pixels live (a window's texture, a plain buffer in memory) is up to the subclass, which points `pixels` at
+// them; none of the drawing calls are virtual, so the rasterisers pay nothing for not knowing which it is.
+class RenderTarget {
+public:
+	size_t width = 0;
+	size_t height = 0;
+	// Distance (in pixels) between the start of one row and the start of the next. Rows are padded out to whole
+	// cache lines, like the depth buffer's, so a SIMD_LANES wide store that starts inside a row stays inside it.
+	size_t stride = 0;
+	DepthBuffer depthBuffer;
+
+protected:
+	uint32_t *pixels = nullptr;
+
+private:
+	// setPixelColour and getPixelColour calls that fell outside the target, only counted in debug builds. Atomic
+	// because several threads draw into the target at once.
+	std::atomic<size_t> outOfRangeCount{0};
+
+public:
+	RenderTarget() = default;
+	RenderTarget(size_t w, size_t h);
+	virtual ~RenderTarget() = default;
+	RenderTarget(const RenderTarget &) = delete;
+	RenderTarget &operator=(const RenderTarget &) = delete;
+
+	// These write the target straight away, on the calling thread; see ImageWriter.h for the formats
+	void savePPM(const std::string &filename) const;
+	void saveBMP(const std::string &filename) const;
+	void save(const std::string &filename) const;
+	// Copies the visible pixels, for an AsyncImageWriter to write out while drawing carries on
+	std::shared_ptr<const Image> snapshot() const;
+	// Checked access: anything outside the target is ignored (or reads as 0xFFFFFFFF)
+	void setPixelColour(size_t x, size_t y, uint32_t colour);
+	uint32_t getPixelColour(size_t x, size_t y);
+	void clearPixels();
+	size_t outOfRangeAccesses() const { return outOfRangeCount.load(std::memory_order_relaxed); }
+
+	// Unchecked access for inner loops that have already clipped to the target. A row holds `width` pixels,
+	// followed by padding up to `stride` which is never shown.
+	uint32_t *row(size_t y) { return pixels + y * stride; }
+	const uint32_t *row(size_t y) const { return pixels + y * stride; }
+	void fillSpan(size_t x, size_t y, size_t count, uint32_t colour) { std::fill_n(row(y) + x, count, colour); }
+	// Writes the lanes of `colours` whose mask is set to pixels x to x + SIMD_LANES - 1. Lanes that are masked off
+	// may still be read and rewritten (see simdStoreMasked), so all of them must lie within the row's padding, and
+	// no other thread may be drawing to those pixels at the same time.
+	void storeMasked(size_t x, size_t y, SimdMask mask, SimdInt colours) { simdStoreMasked(row(y) + x, mask, colours); }
+
+protected:
+	// 16 pixels is one 64 byte cache line
+	static size_t paddedStride(size_t w) { return (w + 15) / 16 * 16; }
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+// Thin wrapper over the widest float vector the compiler has been told it can use (AVX2, SSE2 or plain scalar),
+// so that hot loops can be written once in terms of SIMD_LANES wide chunks. Masks are kept in a separate type
+// because the scalar fallback represents them as bools rather than as all-ones bit patterns. SimdInt holds
+// SIMD_LANES 32-bit integers, which is what packed colours are stored as.
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+#include <cstdint>
+#define SIMD_LANES 8
+typedef __m256 SimdFloat;
+typedef __m256 SimdMask;
+typedef __m256i SimdInt;
+
+inline SimdFloat simdSet(float value) { return _mm256_set1_ps(value); }
+inline SimdFloat simdLoad(const float *source) { return _mm256_loadu_ps(source); }
+inline void simdStore(float *destination, SimdFloat value) { _mm256_storeu_ps(destination, value); }
+inline SimdFloat simdLaneOffsets() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+inline SimdFloat simdAdd(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a, b); }
+inline SimdFloat simdSub(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a, b); }
+inline SimdFloat simdMul(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a, b); }
+inline SimdFloat simdDiv(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a, b); }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a, b); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a, b); }
+inline SimdMask simdGreater(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+inline SimdMask simdGreaterEqual(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+inline SimdMask simdLessEqual(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline SimdMask simdAnd(SimdMask a, SimdMask b) { return _mm256_and_ps(a, b); }
+inline SimdMask simdOr(SimdMask a, SimdMask b) { return _mm256_or_ps(a, b); }
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat ifTrue, SimdFloat ifFalse) { return _mm256_blendv_ps(ifFalse, ifTrue, mask); }
+inline int simdMoveMask(SimdMask mask) { return _mm256_movemask_ps(mask); }
+inline SimdInt simdSetInt(uint32_t value) { return _mm256_set1_epi32(int(value)); }
+inline SimdInt simdLoadInt(const uint32_t *source) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source)); }
+// writes only the lanes whose mask is set; the others are left untouched in memory
+inline void simdStoreMasked(uint32_t *destination, SimdMask mask, SimdInt value) {
+	_mm256_maskstore_epi32(reinterpret_cast<int *>(destination), _mm256_castps_si256(mask), value);
+}
+
+#elif defined(__SSE2__) || defined(_M_X64)
+
+#include <emmintrin.h>
+#include <cstdint>
+#define SIMD_LANES 4
+typedef __m128 SimdFloat;
+typedef __m128 SimdMask;
+typedef __m128i SimdInt;
+
+inline SimdFloat simdSet(float value) { return _mm_set1_ps(value); }
+inline SimdFloat simdLoad(const float *source) { return _mm_loadu_ps(source); }
+inline void simdStore(float *destination, SimdFloat value) { _mm_storeu_ps(destination, value); }
+inline SimdFloat simdLaneOffsets() { return _mm_setr_ps(0, 1, 2, 3); }
+inline SimdFloat simdAdd(SimdFloat a, SimdFloat b) { return _mm_add_ps(a, b); }
+inline SimdFloat simdSub(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a, b); }
+inline SimdFloat simdMul(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a, b); }
+inline SimdFloat simdDiv(SimdFloat a, SimdFloat b) { return _mm_div_ps(a, b); }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm_min_ps(a, b); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm_max_ps(a, b); }
+inline SimdMask simdGreater(SimdFloat a, SimdFloat b) { return _mm_cmpgt_ps(a, b); }
+inline SimdMask simdGreaterEqual(SimdFloat a, SimdFloat b) { return _mm_cmpge_ps(a, b); }
+inline SimdMask simdLessEqual(SimdFloat a, SimdFloat b) { return _mm_cmple_ps(a, b); }
+inline SimdMask simdAnd(SimdMask a, SimdMask b) { return _mm_and_ps(a, b); }
+inline SimdMask simdOr(SimdMask a, SimdMask b) { return _mm_or_ps(a, b); }
+// SSE2 has no blend instruction, so build one out of the bitwise operations
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat ifTrue, SimdFloat ifFalse) {
+	return _mm_or_ps(_mm_and_ps(mask, ifTrue), _mm_andnot_ps(mask, ifFalse));
+}
+inline int simdMoveMask(SimdMask mask) { return _mm_movemask_ps(mask); }
+inline SimdInt simdSetInt(uint32_t value) { return _mm_set1_epi32(int(value)); }
+inline SimdInt simdLoadInt(const uint32_t *source) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(source)); }
+// SSE2's masked store (maskmovdqu) bypasses the cache, so blend with what is there instead. That reads and rewrites
+// the lanes that are masked off, so nothing else may be writing to them at the same time.
+inline void simdStoreMasked(uint32_t *destination, SimdMask mask, SimdInt value) {
+	__m128i *address = reinterpret_cast<__m128i *>(destination);
+	__m128i integerMask = _mm_castps_si128(mask);
+	_mm_storeu_si128(address, _mm_or_si128(_mm_and_si128(integerMask, value), _mm_andnot_si128(integerMask, _mm_loadu_si128(address))));
+}
+
+#else
+
+#include <algorithm>
+#include <cstdint>
+#define SIMD_LANES 1
+typedef float SimdFloat;
+typedef bool SimdMask;
+typedef uint32_t SimdInt;
+
+inline SimdFloat simdSet(float value) { return value; }
+inline SimdFloat simdLoad(const float *source) { return *source; }
+inline void simdStore(float *destination, SimdFloat value) { *destination = value; }
+inline SimdFloat simdLaneOffsets() { return 0.0f; }
+inline SimdFloat simdAdd(SimdFloat a, SimdFloat b) { return a + b; }
+inline SimdFloat simdSub(SimdFloat a, SimdFloat b) { return a - b; }
+inline SimdFloat simdMul(SimdFloat a, SimdFloat b) { return a * b; }
+inline SimdFloat simdDiv(SimdFloat a, SimdFloat b) { return a / b; }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return std::min(a, b); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return std::max(a, b); }
+inline SimdMask simdGreater(SimdFloat a, SimdFloat b) { return a > b; }
+inline SimdMask simdGreaterEqual(SimdFloat a, SimdFloat b) { return a >= b; }
+inline SimdMask simdLessEqual(SimdFloat a, SimdFloat b) { return a <= b; }
+inline SimdMask simdAnd(SimdMask a, SimdMask b) { return a && b; }
+inline SimdMask simdOr(SimdMask a, SimdMask b) { return a || b; }
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat ifTrue, SimdFloat ifFalse) { return mask ? ifTrue : ifFalse; }
+inline int simdMoveMask(SimdMask mask) { return mask ? 1 : 0; }
+inline SimdInt simdSetInt(uint32_t value) { return value; }
+inline SimdInt simdLoadInt(const uint32_t *source) { return *source; }
+inline void simdStoreMasked(uint32_t *destination, SimdMask mask, SimdInt value) { if (mask) *destination = value; }
+
+#endif
@@ -0,0 +1,54 @@
+#include "TextureCache.h"
+#include <exception>
+#include <unordered_set>
+#include "ThreadPool.h"
+
+const TextureMap &TextureCache::get(const std::string &filename) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto existing = textures.find(filename);
+		if (existing != textures.end()) return existing->second;
+	}
+	// load before inserting, so that a file that fails to parse doesn't leave an empty texture behind. If another
+	// thread got there first, its copy is kept (references to it may already be out) and this one is dropped.
+	TextureMap texture(filename);
+	std::lock_guard<std::mutex> lock(mutex);
+	return textures.emplace(filename, std::move(texture)).first->second;
+}
+
+void TextureCache::preload(const std::vector<std::string> &filenames, ThreadPool *pool) {
+	std::vector<std::string> missing;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::unordered_set<std::string> seen;
+		for (const auto &filename : filenames) {
+			if (textures.count(filename) == 0 && seen.insert(filename).second) missing.push_back(filename);
+		}
+	}
+
+	// parallelFor can't carry an exception back to this thread, so each task keeps its own
+	std::vector<std::exception_ptr> errors(missing.size());
+	auto body = [&](size_t i) {
+		try {
+			get(missing[i]);
+		} catch (...) {
+			errors[i] = std::current_exception();
+		}
+	};
+	if (pool != nullptr) pool->parallelFor(missing.size(), body);
+	else for (size_t i = 0; i < missing.size(); i++) body(i);
+
+	for (const auto &error : errors) {
+		if (error) std::rethrow_exception(error);
+	}
+}
+
+size_t TextureCache::size() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return textures.size();
+}
+
+void TextureCache::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+	textures.clear();
+}
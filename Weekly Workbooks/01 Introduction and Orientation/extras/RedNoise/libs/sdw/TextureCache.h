@@ -0,0 +1,32 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "TextureMap.h"
+
+class ThreadPool;
+
+// Loads each texture file once, however many materials or triangles use it. References handed out stay valid
+// until the cache is cleared or destroyed, so callers can keep a pointer to the texture instead of its path.
+// Files are read and decoded without holding the cache's lock, so threads loading different files don't wait for
+// each other.
+class TextureCache {
+public:
+	TextureCache() = default;
+	TextureCache(const TextureCache &) = delete;
+	TextureCache &operator=(const TextureCache &) = delete;
+
+	// Returns the texture loaded from filename, reading it on the first request
+	const TextureMap &get(const std::string &filename);
+	// Loads every file in the list that isn't cached yet, one file per task on the pool if there is one. If any
+	// of them fail, the rest are still cached and the first failure (in list order) is rethrown afterwards.
+	void preload(const std::vector<std::string> &filenames, ThreadPool *pool = nullptr);
+	size_t size() const;
+	void clear();
+
+private:
+	mutable std::mutex mutex;
+	std::unordered_map<std::string, TextureMap> textures;
+};
@@ -1,32 +1,133 @@
 #include "TextureMap.h"
+#include <algorithm>
+#include "PpmFile.h"
+
+constexpr size_t MipLevel::TILE_SIZE;
+
+MipLevel::MipLevel() : width(0), height(0), tilesAcross(0) {}
+
+MipLevel::MipLevel(size_t w, size_t h) : width(w), height(h) {
+	tilesAcross = (width + TILE_SIZE - 1) / TILE_SIZE;
+	size_t tilesDown = (height + TILE_SIZE - 1) / TILE_SIZE;
+	texels.resize(tilesAcross * tilesDown * TILE_SIZE * TILE_SIZE);
+}
 
 TextureMap::TextureMap() = default;
+// The file is mapped rather than streamed through an ifstream a byte at a time, and each row is converted to
+// packed texels in one go before being scattered into the tiles
 TextureMap::TextureMap(const std::string &filename) {
-	std::ifstream inputStream(filename, std::ifstream::binary);
-	std::string nextLine;
-	// Get the "P6" magic number
-	std::getline(inputStream, nextLine);
-	// Read the width and height line
-	std::getline(inputStream, nextLine);
-	// Skip over any comment lines !
-	while (nextLine.at(0) == '#') std::getline(inputStream, nextLine);
-	auto widthAndHeight = split(nextLine, ' ');
-	if (widthAndHeight.size() != 2)
-		throw std::invalid_argument("Failed to parse width and height line, line was `" + nextLine + "`");
-
-	width = std::stoi(widthAndHeight[0]);
-	height = std::stoi(widthAndHeight[1]);
-	// Read the max value (which we assume is 255)
-	std::getline(inputStream, nextLine);
-
-	pixels.resize(width * height);
-	for (size_t i = 0; i < width * height; i++) {
-		int red = inputStream.get();
-		int green = inputStream.get();
-		int blue = inputStream.get();
-		pixels[i] = ((255 << 24) + (red << 16) + (green << 8) + (blue));
+	PpmFile file(filename);
+	width = file.width();
+	height = file.height();
+
+	levels.emplace_back(width, height);
+	MipLevel &fullSize = levels[0];
+	std::vector<uint32_t> row(width);
+	for (size_t y = 0; y < height; y++) {
+		file.convertRow(y, row.data());
+		for (size_t x = 0; x < width; x++) fullSize.set(x, y, row[x]);
+	}
+
+	buildMipChain();
+}
+
+// Each level averages 2x2 blocks of the level above it. Odd sizes round down, with the last row or column of
+// the bigger level folded into the block next to it, so no texels are dropped.
+void TextureMap::buildMipChain() {
+	while (levels.back().width > 1 || levels.back().height > 1) {
+		const MipLevel &source = levels.back();
+		MipLevel next(std::max<size_t>(1, source.width / 2), std::max<size_t>(1, source.height / 2));
+		for (size_t y = 0; y < next.height; y++) {
+			size_t firstRow = y * 2;
+			size_t lastRow = (y == next.height - 1) ? source.height - 1 : firstRow + 1;
+			for (size_t x = 0; x < next.width; x++) {
+				size_t firstColumn = x * 2;
+				size_t lastColumn = (x == next.width - 1) ? source.width - 1 : firstColumn + 1;
+
+				uint32_t sums[4] = {0, 0, 0, 0};
+				uint32_t count = 0;
+				for (size_t sourceY = firstRow; sourceY <= lastRow; sourceY++) {
+					for (size_t sourceX = firstColumn; sourceX <= lastColumn; sourceX++) {
+						uint32_t texel = source.get(sourceX, sourceY);
+						for (int channel = 0; channel < 4; channel++) sums[channel] += (texel >> (channel * 8)) & 0xFF;
+						count++;
+					}
+				}
+				uint32_t averaged = 0;
+				for (int channel = 0; channel < 4; channel++) averaged |= ((sums[channel] + count / 2) / count) << (channel * 8);
+				next.set(x, y, averaged);
+			}
+		}
+		// source is a reference into levels, so it mustn't be used once the vector has grown
+		levels.push_back(std::move(next));
+	}
+}
+
+float TextureMap::levelOfDetail(float dudx, float dvdx, float dudy, float dvdy) const {
+	float alongX = (dudx * width) * (dudx * width) + (dvdx * height) * (dvdx * height);
+	float alongY = (dudy * width) * (dudy * width) + (dvdy * height) * (dvdy * height);
+	// half the log of the squared length is the log of the length, without taking a square root
+	return 0.5f * std::log2(std::max(alongX, alongY));
+}
+
+namespace {
+	size_t wrap(long coordinate, size_t size) {
+		if (coordinate >= 0 && coordinate < long(size)) return size_t(coordinate);
+		long wrapped = coordinate % long(size);
+		return size_t(wrapped < 0 ? wrapped + long(size) : wrapped);
+	}
+
+	// Blends two packed texels with an 8 bit fixed point weight, two channels at a time: with the other channels
+	// masked out each one has 16 bits of room, which is exactly enough for a channel times a weight of up to 256
+	uint32_t blendTexels(uint32_t a, uint32_t b, float proportion) {
+		uint32_t weight = uint32_t(proportion * 256 + 0.5f);
+		uint32_t redBlue = (((a & 0x00FF00FF) * (256 - weight) + (b & 0x00FF00FF) * weight) >> 8) & 0x00FF00FF;
+		uint32_t alphaGreen = (((a >> 8) & 0x00FF00FF) * (256 - weight) + ((b >> 8) & 0x00FF00FF) * weight) & 0xFF00FF00;
+		return redBlue | alphaGreen;
+	}
+}
+
+uint32_t TextureMap::sampleLevelNearest(const MipLevel &level, float u, float v) const {
+	size_t x = wrap(long(std::floor(u * level.width)), level.width);
+	size_t y = wrap(long(std::floor(v * level.height)), level.height);
+	return level.get(x, y);
+}
+
+uint32_t TextureMap::sampleLevelBilinear(const MipLevel &level, float u, float v) const {
+	// texel centres are half a texel in from their top left corners
+	float texelX = u * level.width - 0.5f;
+	float texelY = v * level.height - 0.5f;
+	float left = std::floor(texelX);
+	float top = std::floor(texelY);
+	float proportionX = texelX - left;
+	float proportionY = texelY - top;
+
+	size_t x0 = wrap(long(left), level.width);
+	size_t x1 = wrap(long(left) + 1, level.width);
+	size_t y0 = wrap(long(top), level.height);
+	size_t y1 = wrap(long(top) + 1, level.height);
+
+	uint32_t upper = blendTexels(level.get(x0, y0), level.get(x1, y0), proportionX);
+	uint32_t lower = blendTexels(level.get(x0, y1), level.get(x1, y1), proportionX);
+	return blendTexels(upper, lower, proportionY);
+}
+
+uint32_t TextureMap::sample(float u, float v, float lod, TextureFilter filter) const {
+	float lastLevel = float(levels.size() - 1);
+	// written so that a NaN level of detail ends up at the full size level
+	lod = lod > 0 ? std::min(lod, lastLevel) : 0.0f;
+
+	if (filter == TextureFilter::Trilinear) {
+		size_t finer = size_t(lod);
+		float proportion = lod - float(finer);
+		uint32_t finerSample = sampleLevelBilinear(levels[finer], u, v);
+		if (proportion == 0) return finerSample;
+		return blendTexels(finerSample, sampleLevelBilinear(levels[finer + 1], u, v), proportion);
 	}
-	inputStream.close();
+
+	const MipLevel &level = levels[size_t(lod + 0.5f)];
+	if (filter == TextureFilter::Bilinear) return sampleLevelBilinear(level, u, v);
+	return sampleLevelNearest(level, u, v);
 }
 
 std::ostream &operator<<(std::ostream &os, const TextureMap &map) {
@@ -4,15 +4,73 @@
 #include <fstream>
 #include <stdexcept>
 #include "Utils.h"
+#include "AlignedAllocator.h"
 #include <cstdint>
+#include <cmath>
+
+enum class TextureFilter {
+	// nearest texel of the nearest mip level
+	Nearest,
+	// four texels of the nearest mip level, blended by distance
+	Bilinear,
+	// bilinear samples from the two mip levels either side of the level of detail, blended together
+	Trilinear
+};
+
+// One level of the mip chain. Texels are stored in 8x8 tiles (256 bytes, four cache lines) laid out row by row,
+// and in Z (Morton) order inside each tile, so texels that are close in both u and v are close in memory too.
+// The level is padded up to whole tiles; the padding is never sampled.
+struct MipLevel {
+	static constexpr size_t TILE_SIZE = 8;
+
+	size_t width;
+	size_t height;
+	size_t tilesAcross;
+	std::vector<uint32_t, AlignedAllocator<uint32_t>> texels;
+
+	MipLevel();
+	MipLevel(size_t w, size_t h);
+
+	size_t indexOf(size_t x, size_t y) const {
+		size_t tile = (y / TILE_SIZE) * tilesAcross + x / TILE_SIZE;
+		return tile * TILE_SIZE * TILE_SIZE + mortonIndex(x % TILE_SIZE, y % TILE_SIZE);
+	}
+	uint32_t get(size_t x, size_t y) const { return texels[indexOf(x, y)]; }
+	void set(size_t x, size_t y, uint32_t texel) { texels[indexOf(x, y)] = texel; }
+
+	// interleaves the bits of x and y (both below TILE_SIZE), x taking the lowest bit
+	static size_t mortonIndex(size_t x, size_t y) {
+		return (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2) | ((x & 4) << 2) | ((y & 4) << 3);
+	}
+};
 
 class TextureMap {
 public:
 	size_t width;
 	size_t height;
-	std::vector<uint32_t> pixels;
+	// levels[0] is the image as loaded, each level after that is half the size of the one before, down to 1x1
+	std::vector<MipLevel> levels;
 
 	TextureMap();
+	// Loads a binary PPM file, throwing as PpmFile does if it can't be read
 	TextureMap(const std::string &filename);
+
+	// Texel (x, y) of a mip level, in pixels from the top left corner
+	uint32_t texel(size_t x, size_t y, size_t level = 0) const { return levels[level].get(x, y); }
+
+	// Mip level whose texels are about a pixel apart on screen, given how far the texture coordinates move per
+	// pixel along x and y (as fractions of the whole texture). Negative when the texture is magnified.
+	float levelOfDetail(float dudx, float dvdx, float dudy, float dvdy) const;
+	// Samples the texture at (u, v), which span [0, 1] across the image and wrap around outside that range,
+	// using the mip level(s) picked by lod (clamped to the levels there are)
+	uint32_t sample(float u, float v, float lod, TextureFilter filter) const;
+	// Nearest texel of the full size image
+	uint32_t sampleNearest(float u, float v) const { return sample(u, v, 0, TextureFilter::Nearest); }
+
 	friend std::ostream &operator<<(std::ostream &os, const TextureMap &point);
+
+private:
+	void buildMipChain();
+	uint32_t sampleLevelNearest(const MipLevel &level, float u, float v) const;
+	uint32_t sampleLevelBilinear(const MipLevel &level, float u, float v) const;
 };
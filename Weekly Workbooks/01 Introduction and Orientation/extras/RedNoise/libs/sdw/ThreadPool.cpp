@@ -0,0 +1,193 @@
+#include "ThreadPool.h"
+
+namespace {
+
+uint64_t packRange(uint64_t begin, uint64_t end) {
+	return begin | end << 32;
+}
+
+uint32_t rangeBegin(uint64_t range) {
+	return uint32_t(range);
+}
+
+uint32_t rangeEnd(uint64_t range) {
+	return uint32_t(range >> 32);
+}
+
+}
+
+ThreadPool::ThreadPool(size_t threadCount) :
+		jobBody(nullptr),
+		jobGeneration(0),
+		busyWorkers(0),
+		stopping(false) {
+	// hardware_concurrency is allowed to return 0 when it can't tell
+	if (threadCount == 0) threadCount = 1;
+	shares.reset(new Share[threadCount]);
+	for (size_t i = 1; i < threadCount; i++) workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	jobAvailable.notify_all();
+	for (auto &worker : workers) worker.join();
+}
+
+size_t ThreadPool::size() const {
+	return workers.size() + 1;
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)> &body) {
+	if (count == 0) return;
+	if (workers.empty() || count == 1) {
+		for (size_t i = 0; i < count; i++) body(i);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobBody = &body;
+		for (size_t share = 0; share < size(); share++) {
+			shares[share].range.store(packRange(count * share / size(), count * (share + 1) / size()), std::memory_order_relaxed);
+		}
+		busyWorkers = workers.size();
+		jobGeneration++;
+	}
+	jobAvailable.notify_all();
+	runJob(0);
+	// body lives on the caller's stack, so every worker has to be done with it before returning
+	std::unique_lock<std::mutex> lock(mutex);
+	jobFinished.wait(lock, [this] { return busyWorkers == 0; });
+	jobBody = nullptr;
+}
+
+void ThreadPool::runJob(size_t share) {
+	size_t index;
+	while (takeIndex(share, index)) (*jobBody)(index);
+}
+
+bool ThreadPool::takeIndex(size_t share, size_t &index) {
+	std::atomic<uint64_t> &own = shares[share].range;
+	while (true) {
+		uint64_t range = own.load(std::memory_order_relaxed);
+		if (rangeBegin(range) < rangeEnd(range)) {
+			if (!own.compare_exchange_weak(range, packRange(rangeBegin(range) + 1, rangeEnd(range)), std::memory_order_relaxed)) continue;
+			index = rangeBegin(range);
+			return true;
+		}
+
+		// Only the owner ever moves a share's begin, and it can't while it is stealing, so no one else can be
+		// taking from this share now and the stolen indices can simply be stored in it
+		size_t victim = size();
+		uint32_t mostLeft = 0;
+		for (size_t other = 0; other < size(); other++) {
+			uint64_t otherRange = shares[other].range.load(std::memory_order_relaxed);
+			uint32_t left = rangeEnd(otherRange) > rangeBegin(otherRange) ? rangeEnd(otherRange) - rangeBegin(otherRange) : 0;
+			if (left > mostLeft) {
+				victim = other;
+				mostLeft = left;
+			}
+		}
+		if (victim == size()) return false;
+		uint64_t victimRange = shares[victim].range.load(std::memory_order_relaxed);
+		uint32_t begin = rangeBegin(victimRange);
+		uint32_t end = rangeEnd(victimRange);
+		if (begin >= end) continue;
+		uint32_t middle = end - (end - begin + 1) / 2;
+		if (!shares[victim].range.compare_exchange_strong(victimRange, packRange(begin, middle), std::memory_order_relaxed)) continue;
+		own.store(packRange(middle, end), std::memory_order_relaxed);
+	}
+}
+
+void ThreadPool::workerLoop(size_t share) {
+	size_t seenGeneration = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		jobAvailable.wait(lock, [&] { return stopping || jobGeneration != seenGeneration || !tasks.empty(); });
+		if (stopping) return;
+		if (jobGeneration != seenGeneration) {
+			seenGeneration = jobGeneration;
+			lock.unlock();
+			runJob(share);
+			lock.lock();
+			busyWorkers--;
+			jobFinished.notify_one();
+			continue;
+		}
+		Task task = std::move(tasks.back());
+		tasks.pop_back();
+		lock.unlock();
+		runTask(task);
+		lock.lock();
+	}
+}
+
+void ThreadPool::submit(Task task) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push_back(std::move(task));
+	}
+	jobAvailable.notify_one();
+}
+
+bool ThreadPool::runQueuedTask() {
+	Task task;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (tasks.empty()) return false;
+		task = std::move(tasks.back());
+		tasks.pop_back();
+	}
+	runTask(task);
+	return true;
+}
+
+void ThreadPool::runTask(Task &task) {
+	std::exception_ptr error;
+	try {
+		task.body();
+	} catch (...) {
+		error = std::current_exception();
+	}
+	task.group->finished(error);
+}
+
+TaskGroup::TaskGroup(ThreadPool &pool) : pool(pool) {}
+
+TaskGroup::~TaskGroup() {
+	try {
+		wait();
+	} catch (...) {
+	}
+}
+
+void TaskGroup::run(std::function<void()> task) {
+	pending.fetch_add(1, std::memory_order_relaxed);
+	ThreadPool::Task queued{std::move(task), this};
+	if (pool.workers.empty()) ThreadPool::runTask(queued);
+	else pool.submit(std::move(queued));
+}
+
+// Helping out instead of sleeping means a thread waiting here never holds up the tasks it is waiting for, and
+// when there's nothing left to help with the remaining tasks are already running, so yielding won't be for long
+void TaskGroup::wait() {
+	while (pending.load(std::memory_order_acquire) != 0) {
+		if (!pool.runQueuedTask()) std::this_thread::yield();
+	}
+	std::lock_guard<std::mutex> lock(errorMutex);
+	if (error) {
+		std::exception_ptr thrown = error;
+		error = nullptr;
+		std::rethrow_exception(thrown);
+	}
+}
+
+void TaskGroup::finished(std::exception_ptr taskError) {
+	if (taskError) {
+		std::lock_guard<std::mutex> lock(errorMutex);
+		if (!error) error = taskError;
+	}
+	pending.fetch_sub(1, std::memory_order_release);
+}
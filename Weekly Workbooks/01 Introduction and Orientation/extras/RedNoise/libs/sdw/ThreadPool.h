@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+// A fixed set of worker threads that stay alive for the lifetime of the pool, so that per-frame parallel work
+// doesn't pay for thread creation. The calling thread always takes part in the work as well, which means a pool
+// created with a thread count of 1 simply runs everything inline.
+// Work comes either as a flat parallelFor over a range of indices, or as TaskGroup tasks for recursive work
+// whose shape isn't known up front. A parallelFor waits for workers that are busy with tasks to finish them
+// before they join in, so the two are best not mixed while either is in full flow.
+class ThreadPool {
+public:
+	explicit ThreadPool(size_t threadCount = std::thread::hardware_concurrency());
+	~ThreadPool();
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	// Number of threads that work on a job, including the caller
+	size_t size() const;
+	// Calls body(index) once for every index in [0, count), which must be below 2^32, and returns when every call
+	// has finished. Each thread starts on a contiguous share of the indices, in order, so neighbouring indices
+	// tend to run on the same thread; a thread that runs out steals the back half of whichever share has the most
+	// left, so they all finish within about one call of each other however uneven the calls are. Must not be
+	// called from inside another parallelFor body, or from a task.
+	void parallelFor(size_t count, const std::function<void(size_t)> &body);
+
+private:
+	friend class TaskGroup;
+
+	struct Task {
+		std::function<void()> body;
+		TaskGroup *group;
+	};
+
+	// The indices [begin, end) that one thread has left of a parallelFor, packed as begin | end << 32 so that the
+	// owner taking from the front and thieves taking from the back can each do it with one compare and swap. On
+	// a cache line of its own, since the owner updates it for every index.
+	struct alignas(64) Share {
+		std::atomic<uint64_t> range{0};
+	};
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable jobAvailable;
+	std::condition_variable jobFinished;
+	const std::function<void(size_t)> *jobBody;
+	// one per thread, the caller's first
+	std::unique_ptr<Share[]> shares;
+	size_t jobGeneration;
+	size_t busyWorkers;
+	bool stopping;
+	// queued tasks from every group, taken newest first so that recursive work stays depth first
+	std::deque<Task> tasks;
+
+	void workerLoop(size_t share);
+	void runJob(size_t share);
+	// Takes the next index from the thread's own share, stealing more if it has run out, and returns false once
+	// every share is empty
+	bool takeIndex(size_t share, size_t &index);
+	void submit(Task task);
+	// Runs one queued task on the calling thread, returning false if there weren't any
+	bool runQueuedTask();
+	static void runTask(Task &task);
+};
+
+// Tasks that run on a ThreadPool's threads and may add more tasks to the same group, for divide and conquer work
+// like building a tree. wait() runs queued tasks on the calling thread rather than just blocking, so a task can
+// start a group of its own and wait for it. With a single threaded pool every task runs inline inside run().
+class TaskGroup {
+public:
+	explicit TaskGroup(ThreadPool &pool);
+	// waits for any tasks still running, dropping any exception they threw
+	~TaskGroup();
+	TaskGroup(const TaskGroup &) = delete;
+	TaskGroup &operator=(const TaskGroup &) = delete;
+
+	void run(std::function<void()> task);
+	// Returns once every task run in the group (including tasks they ran) has finished, rethrowing the first
+	// exception any of them threw
+	void wait();
+
+private:
+	friend class ThreadPool;
+
+	ThreadPool &pool;
+	std::atomic<size_t> pending{0};
+	std::mutex errorMutex;
+	std::exception_ptr error;
+
+	void finished(std::exception_ptr taskError);
+};
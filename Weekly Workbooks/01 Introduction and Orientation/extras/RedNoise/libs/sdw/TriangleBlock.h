@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <glm/glm.hpp>
+#include "Bvh.h"
+#include "Simd.h"
+
+// SIZE triangles (one per SIMD lane) in structure of arrays form, each as the corner and two edges that
+// intersectTriangle wants, so that one ray can be tested against all of them at once. A leaf whose triangle
+// count isn't a multiple of SIZE fills out its last block with triangles of all zeros, which no ray ever hits.
+struct TriangleBlock {
+	static constexpr int SIZE = SIMD_LANES;
+
+	// [axis][lane]
+	float vertex0[3][SIZE];
+	float edge1[3][SIZE];
+	float edge2[3][SIZE];
+	// index of each triangle in the mesh the BVH was built from
+	uint32_t index[SIZE];
+
+	void set(int lane, const BvhTriangle &triangle) {
+		for (int axis = 0; axis < 3; axis++) {
+			vertex0[axis][lane] = triangle.vertex0[axis];
+			edge1[axis][lane] = triangle.edge1[axis];
+			edge2[axis][lane] = triangle.edge2[axis];
+		}
+		index[lane] = triangle.index;
+	}
+};
+
+// The lanes (as a bit mask) whose triangles the ray crosses with minDistance < t < maxDistance, computed with the
+// same arithmetic in the same order as intersectTriangle, and each one's t, u and v
+inline int intersectBlockLanes(const TriangleBlock &block, const glm::vec3 &origin, const glm::vec3 &direction, float minDistance, float maxDistance, SimdFloat &t, SimdFloat &u, SimdFloat &v) {
+	SimdFloat directionX = simdSet(direction.x), directionY = simdSet(direction.y), directionZ = simdSet(direction.z);
+	SimdFloat edge1X = simdLoad(block.edge1[0]), edge1Y = simdLoad(block.edge1[1]), edge1Z = simdLoad(block.edge1[2]);
+	SimdFloat edge2X = simdLoad(block.edge2[0]), edge2Y = simdLoad(block.edge2[1]), edge2Z = simdLoad(block.edge2[2]);
+
+	// p = direction x edge2
+	SimdFloat pX = simdSub(simdMul(directionY, edge2Z), simdMul(edge2Y, directionZ));
+	SimdFloat pY = simdSub(simdMul(directionZ, edge2X), simdMul(edge2Z, directionX));
+	SimdFloat pZ = simdSub(simdMul(directionX, edge2Y), simdMul(edge2X, directionY));
+	SimdFloat determinant = simdAdd(simdAdd(simdMul(edge1X, pX), simdMul(edge1Y, pY)), simdMul(edge1Z, pZ));
+	// not parallel to the ray, and not one of the padding triangles
+	SimdMask valid = simdOr(simdGreaterEqual(determinant, simdSet(1e-12f)), simdGreaterEqual(simdSet(-1e-12f), determinant));
+	SimdFloat inverseDeterminant = simdDiv(simdSet(1.0f), determinant);
+
+	SimdFloat fromVertex0X = simdSub(simdSet(origin.x), simdLoad(block.vertex0[0]));
+	SimdFloat fromVertex0Y = simdSub(simdSet(origin.y), simdLoad(block.vertex0[1]));
+	SimdFloat fromVertex0Z = simdSub(simdSet(origin.z), simdLoad(block.vertex0[2]));
+	u = simdMul(simdAdd(simdAdd(simdMul(fromVertex0X, pX), simdMul(fromVertex0Y, pY)), simdMul(fromVertex0Z, pZ)), inverseDeterminant);
+	valid = simdAnd(valid, simdAnd(simdGreaterEqual(u, simdSet(0.0f)), simdLessEqual(u, simdSet(1.0f))));
+
+	// q = fromVertex0 x edge1
+	SimdFloat qX = simdSub(simdMul(fromVertex0Y, edge1Z), simdMul(edge1Y, fromVertex0Z));
+	SimdFloat qY = simdSub(simdMul(fromVertex0Z, edge1X), simdMul(edge1Z, fromVertex0X));
+	SimdFloat qZ = simdSub(simdMul(fromVertex0X, edge1Y), simdMul(edge1X, fromVertex0Y));
+	v = simdMul(simdAdd(simdAdd(simdMul(directionX, qX), simdMul(directionY, qY)), simdMul(directionZ, qZ)), inverseDeterminant);
+	valid = simdAnd(valid, simdAnd(simdGreaterEqual(v, simdSet(0.0f)), simdLessEqual(simdAdd(u, v), simdSet(1.0f))));
+	t = simdMul(simdAdd(simdAdd(simdMul(edge2X, qX), simdMul(edge2Y, qY)), simdMul(edge2Z, qZ)), inverseDeterminant);
+	valid = simdAnd(valid, simdAnd(simdGreater(t, simdSet(minDistance)), simdGreater(simdSet(maxDistance), t)));
+	return simdMoveMask(valid);
+}
+
+// intersectTriangle for every triangle in the block at once: whether the ray crosses any of them with
+// 0 < t < maxDistance, filling in hit with the nearest if so
+inline bool intersectTriangleBlock(const TriangleBlock &block, const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, BvhHit &hit) {
+	SimdFloat t, u, v;
+	int lanes = intersectBlockLanes(block, origin, direction, 0.0f, maxDistance, t, u, v);
+	if (lanes == 0) return false;
+	float distances[TriangleBlock::SIZE];
+	simdStore(distances, t);
+	int nearest = -1;
+	for (int lane = 0; lane < TriangleBlock::SIZE; lane++) {
+		if ((lanes >> lane & 1) && (nearest < 0 || distances[lane] < distances[nearest])) nearest = lane;
+	}
+	float us[TriangleBlock::SIZE], vs[TriangleBlock::SIZE];
+	simdStore(us, u);
+	simdStore(vs, v);
+	hit = {distances[nearest], block.index[nearest], us[nearest], vs[nearest]};
+	return true;
+}
+
+// Whether the ray crosses any of the block's triangles with minDistance < t < maxDistance, and nothing else
+inline bool blockOccludes(const TriangleBlock &block, const glm::vec3 &origin, const glm::vec3 &direction, float minDistance, float maxDistance) {
+	SimdFloat t, u, v;
+	return intersectBlockLanes(block, origin, direction, minDistance, maxDistance, t, u, v) != 0;
+}
@@ -0,0 +1,347 @@
+#include "WideBvh.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+constexpr int WideBvh::MAX_CHILDREN;
+constexpr size_t WideBvh::MAX_LEAF_TRIANGLES;
+constexpr uint32_t WideBvh::NO_OCCLUDER;
+constexpr uint32_t WideBvh::FORMAT_VERSION;
+
+static_assert(sizeof(WideBvhNode) == 64, "a WideBvhNode should fill exactly one cache line");
+
+namespace {
+
+// exponents outside this range would make a cell size that isn't a normal float
+constexpr int MIN_EXPONENT = -126;
+constexpr int MAX_EXPONENT = 127;
+// every node's children can be on the stack at once, for each node on the way down from the root
+constexpr size_t STACK_SIZE = (WideBvh::MAX_CHILDREN - 1) * Bvh::MAX_DEPTH + 1;
+
+// 2^exponent, built straight from its bits
+inline float cellSize(int exponent) {
+	uint32_t bits = uint32_t(exponent + 127) << 23;
+	float size;
+	std::memcpy(&size, &bits, sizeof(size));
+	return size;
+}
+
+// Smallest grid whose 255 cells reach from low to high. Cell sizes are powers of two, so `cells * size` is exact
+// and low + cells * size rounds the same way however the compiler evaluates it.
+int gridExponent(float low, float high) {
+	float extent = high - low;
+	if (!(extent > 0)) return MIN_EXPONENT;
+	int exponent = std::max(MIN_EXPONENT, int(std::ceil(std::log2(extent / 255.0f))));
+	while (exponent < MAX_EXPONENT && low + 255.0f * cellSize(exponent) < high) exponent++;
+	return exponent;
+}
+
+// The cell boundaries nearest to low and high that don't cut into [low, high]
+void quantize(float origin, float size, float low, float high, uint8_t &cellLow, uint8_t &cellHigh) {
+	int lowCell = std::min(255, std::max(0, int(std::floor((low - origin) / size))));
+	while (lowCell > 0 && origin + float(lowCell) * size > low) lowCell--;
+	int highCell = std::min(255, std::max(0, int(std::ceil((high - origin) / size))));
+	while (highCell < 255 && origin + float(highCell) * size < high) highCell++;
+	cellLow = uint8_t(lowCell);
+	cellHigh = uint8_t(highCell);
+}
+
+// at the start of serialise's bytes, followed by the nodes and then the blocks
+struct SerialisedHeader {
+	uint64_t key;
+	uint32_t blockLanes;
+	uint32_t nodeCount;
+	uint32_t blockCount;
+	uint32_t padding;
+};
+
+struct Deferred {
+	uint32_t offset;
+	// zero for a node, otherwise the offset is the first triangle of a leaf
+	uint32_t triangleCount;
+	float distance;
+};
+
+// Entry distance along the ray into each of the node's children, or infinity for the ones it misses (or only
+// reaches at maxDistance or further) and for the slots past childCount. The slab test is the binary tree's, on the
+// decoded boxes.
+inline void intersectChildren(const WideBvhNode &node, const glm::vec3 &origin, const glm::vec3 &inverseDirection, float maxDistance, float distances[WideBvh::MAX_CHILDREN]) {
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128 enter = _mm_setzero_ps();
+	__m128 leave = _mm_set1_ps(maxDistance);
+	for (int axis = 0; axis < 3; axis++) {
+		int32_t packed[2];
+		std::memcpy(&packed[0], node.childMin[axis], 4);
+		std::memcpy(&packed[1], node.childMax[axis], 4);
+		__m128i bytes = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(packed)), zero);
+		__m128 cellsLow = _mm_cvtepi32_ps(_mm_unpacklo_epi16(bytes, zero));
+		__m128 cellsHigh = _mm_cvtepi32_ps(_mm_unpackhi_epi16(bytes, zero));
+		__m128 size = _mm_set1_ps(cellSize(node.exponent[axis]));
+		__m128 gridOrigin = _mm_set1_ps(node.origin[axis]);
+		__m128 rayOrigin = _mm_set1_ps(origin[axis]);
+		__m128 inverse = _mm_set1_ps(inverseDirection[axis]);
+		__m128 low = _mm_add_ps(gridOrigin, _mm_mul_ps(cellsLow, size));
+		__m128 high = _mm_add_ps(gridOrigin, _mm_mul_ps(cellsHigh, size));
+		__m128 near = _mm_mul_ps(_mm_sub_ps(low, rayOrigin), inverse);
+		__m128 far = _mm_mul_ps(_mm_sub_ps(high, rayOrigin), inverse);
+		enter = _mm_max_ps(enter, _mm_min_ps(near, far));
+		leave = _mm_min_ps(leave, _mm_max_ps(near, far));
+	}
+	__m128 used = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(node.childCount), _mm_setr_epi32(0, 1, 2, 3)));
+	__m128 hit = _mm_and_ps(_mm_cmple_ps(enter, leave), used);
+	__m128 infinity = _mm_set1_ps(std::numeric_limits<float>::infinity());
+	_mm_storeu_ps(distances, _mm_or_ps(_mm_and_ps(hit, enter), _mm_andnot_ps(hit, infinity)));
+#else
+	for (int child = 0; child < WideBvh::MAX_CHILDREN; child++) {
+		if (child >= node.childCount) {
+			distances[child] = std::numeric_limits<float>::infinity();
+			continue;
+		}
+		float enter = 0.0f;
+		float leave = maxDistance;
+		for (int axis = 0; axis < 3; axis++) {
+			float size = cellSize(node.exponent[axis]);
+			float near = (node.origin[axis] + float(node.childMin[axis][child]) * size - origin[axis]) * inverseDirection[axis];
+			float far = (node.origin[axis] + float(node.childMax[axis][child]) * size - origin[axis]) * inverseDirection[axis];
+			enter = std::max(enter, std::min(near, far));
+			leave = std::min(leave, std::max(near, far));
+		}
+		distances[child] = enter <= leave ? enter : std::numeric_limits<float>::infinity();
+	}
+#endif
+}
+
+}
+
+WideBvh::WideBvh(const Bvh &binary) {
+	if (binary.empty()) return;
+	for (const BvhNode &node : binary.getNodes()) {
+		if (node.triangleCount > MAX_LEAF_TRIANGLES) {
+			throw std::invalid_argument("A wide BVH can't hold a leaf of " + std::to_string(node.triangleCount) + " triangles (at most " + std::to_string(MAX_LEAF_TRIANGLES) + ")");
+		}
+	}
+	// every wide node takes the place of at least one binary interior node, or of the root leaf
+	nodes.reserve(binary.getNodes().size() / 2 + 1);
+	// every leaf wastes less than one block
+	blocks.reserve(binary.getTriangles().size() / TriangleBlock::SIZE + binary.stats().leafCount);
+	collapse(binary, 0);
+}
+
+uint32_t WideBvh::packLeaf(const Bvh &binary, const BvhNode &leaf) {
+	auto firstBlock = uint32_t(blocks.size());
+	for (uint32_t first = 0; first < leaf.triangleCount; first += TriangleBlock::SIZE) {
+		// value initialised, so the lanes past the end of the leaf are all zeros
+		blocks.emplace_back();
+		for (uint32_t lane = 0; lane < TriangleBlock::SIZE && first + lane < leaf.triangleCount; lane++) {
+			blocks.back().set(int(lane), binary.getTriangles()[leaf.offset + first + lane]);
+		}
+	}
+	return firstBlock;
+}
+
+uint32_t WideBvh::collapse(const Bvh &binary, uint32_t binaryNode) {
+	const std::vector<BvhNode> &binaryNodes = binary.getNodes();
+	uint32_t children[MAX_CHILDREN];
+	int childCount = 0;
+	if (binaryNodes[binaryNode].isLeaf()) {
+		// only ever the root, which gets a node of its own with the leaf as its one child
+		children[childCount++] = binaryNode;
+	} else {
+		children[childCount++] = binaryNodes[binaryNode].offset;
+		children[childCount++] = binaryNodes[binaryNode].offset + 1;
+	}
+	while (childCount < MAX_CHILDREN) {
+		int widest = -1;
+		float widestArea = -1.0f;
+		for (int i = 0; i < childCount; i++) {
+			const BvhNode &child = binaryNodes[children[i]];
+			float area = Aabb{child.boundsMin, child.boundsMax}.halfArea();
+			if (!child.isLeaf() && area > widestArea) {
+				widest = i;
+				widestArea = area;
+			}
+		}
+		if (widest < 0) break;
+		uint32_t opened = binaryNodes[children[widest]].offset;
+		children[widest] = opened;
+		children[childCount++] = opened + 1;
+	}
+
+	// the node array grows as the children are collapsed, so the node is only ever referred to by its index (and
+	// starts out all zeros, unused slots included)
+	auto nodeIndex = uint32_t(nodes.size());
+	nodes.emplace_back();
+	{
+		WideBvhNode &node = nodes[nodeIndex];
+		const BvhNode &box = binaryNodes[binaryNode];
+		node.origin = box.boundsMin;
+		node.childCount = uint8_t(childCount);
+		for (int axis = 0; axis < 3; axis++) {
+			int exponent = gridExponent(box.boundsMin[axis], box.boundsMax[axis]);
+			node.exponent[axis] = int8_t(exponent);
+			for (int i = 0; i < childCount; i++) {
+				const BvhNode &child = binaryNodes[children[i]];
+				quantize(node.origin[axis], cellSize(exponent), child.boundsMin[axis], child.boundsMax[axis], node.childMin[axis][i], node.childMax[axis][i]);
+			}
+		}
+	}
+	for (int i = 0; i < childCount; i++) {
+		const BvhNode &child = binaryNodes[children[i]];
+		uint32_t offset = child.isLeaf() ? packLeaf(binary, child) : collapse(binary, children[i]);
+		nodes[nodeIndex].child[i] = offset;
+		nodes[nodeIndex].triangleCount[i] = uint8_t(child.triangleCount);
+	}
+	return nodeIndex;
+}
+
+std::vector<uint8_t> WideBvh::serialise(uint64_t key) const {
+	SerialisedHeader header {key, TriangleBlock::SIZE, uint32_t(nodes.size()), uint32_t(blocks.size()), 0};
+	size_t nodeBytes = nodes.size() * sizeof(WideBvhNode);
+	size_t blockBytes = blocks.size() * sizeof(TriangleBlock);
+	std::vector<uint8_t> bytes(sizeof(header) + nodeBytes + blockBytes);
+	std::memcpy(bytes.data(), &header, sizeof(header));
+	if (nodeBytes != 0) std::memcpy(bytes.data() + sizeof(header), nodes.data(), nodeBytes);
+	if (blockBytes != 0) std::memcpy(bytes.data() + sizeof(header) + nodeBytes, blocks.data(), blockBytes);
+	return bytes;
+}
+
+bool WideBvh::deserialise(ArrayView<uint8_t> bytes, uint64_t key, size_t meshTriangleCount) {
+	nodes.clear();
+	blocks.clear();
+	SerialisedHeader header;
+	if (bytes.size() < sizeof(header)) return false;
+	std::memcpy(&header, bytes.data(), sizeof(header));
+	if (header.key != key || header.blockLanes != TriangleBlock::SIZE) return false;
+	if (bytes.size() != sizeof(header) + uint64_t(header.nodeCount) * sizeof(WideBvhNode) + uint64_t(header.blockCount) * sizeof(TriangleBlock)) return false;
+	nodes.resize(header.nodeCount);
+	blocks.resize(header.blockCount);
+	const uint8_t *nodeBytes = bytes.data() + sizeof(header);
+	if (!nodes.empty()) std::memcpy(nodes.data(), nodeBytes, nodes.size() * sizeof(WideBvhNode));
+	if (!blocks.empty()) std::memcpy(blocks.data(), nodeBytes + nodes.size() * sizeof(WideBvhNode), blocks.size() * sizeof(TriangleBlock));
+
+	// Traversal trusts the tree completely, so a damaged one mustn't be able to send it out of bounds, round in
+	// circles or past the end of its stack. collapse writes every node before its children, so they always come
+	// later in the array, and no deeper than the binary tree was.
+	bool valid = true;
+	std::vector<uint8_t> depth(nodes.size(), 0);
+	for (size_t i = 0; i < nodes.size() && valid; i++) {
+		const WideBvhNode &node = nodes[i];
+		valid = node.childCount >= 1 && node.childCount <= MAX_CHILDREN;
+		for (int child = 0; child < node.childCount && valid; child++) {
+			uint32_t offset = node.child[child];
+			if (node.triangleCount[child] == 0) {
+				valid = offset > i && offset < nodes.size() && depth[i] + 1u < Bvh::MAX_DEPTH;
+				if (valid) depth[offset] = std::max(depth[offset], uint8_t(depth[i] + 1));
+			} else {
+				uint64_t blockCount = (node.triangleCount[child] + TriangleBlock::SIZE - 1) / TriangleBlock::SIZE;
+				valid = offset + blockCount <= blocks.size();
+			}
+		}
+	}
+	for (size_t i = 0; i < blocks.size() && valid; i++) {
+		for (int lane = 0; lane < TriangleBlock::SIZE; lane++) valid = valid && blocks[i].index[lane] < meshTriangleCount;
+	}
+	if (!valid) {
+		nodes.clear();
+		blocks.clear();
+	}
+	return valid;
+}
+
+bool WideBvh::closestHit(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, BvhHit &hit) const {
+	return traverse<false>(origin, direction, maxDistance, hit);
+}
+
+bool WideBvh::anyHit(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, BvhHit &hit) const {
+	return traverse<true>(origin, direction, maxDistance, hit);
+}
+
+bool WideBvh::occluded(const glm::vec3 &origin, const glm::vec3 &direction, float minDistance, float maxDistance, uint32_t *lastOccluder) const {
+	if (lastOccluder != nullptr && *lastOccluder < blocks.size() && blockOccludes(blocks[*lastOccluder], origin, direction, minDistance, maxDistance)) return true;
+	if (nodes.empty()) return false;
+	glm::vec3 inverseDirection = 1.0f / direction;
+
+	// The first hit ends the search, so there is no closest distance to drop entries by, and sorting the children
+	// nearest first cost more than it saved: a blocked shadow ray is usually blocked close to where it starts, where
+	// either order finds the blocker in the same leaf or so, and a ray that gets through has to visit every child
+	// it hits whatever the order. They go on the stack as they are, so the first child is the next one taken off.
+	Deferred stack[STACK_SIZE];
+	size_t stackSize = 0;
+	stack[stackSize++] = {0, 0, 0.0f};
+	while (stackSize != 0) {
+		Deferred next = stack[--stackSize];
+		if (next.triangleCount != 0) {
+			uint32_t blockCount = (next.triangleCount + TriangleBlock::SIZE - 1) / TriangleBlock::SIZE;
+			for (uint32_t i = next.offset; i < next.offset + blockCount; i++) {
+				if (blockOccludes(blocks[i], origin, direction, minDistance, maxDistance)) {
+					if (lastOccluder != nullptr) *lastOccluder = i;
+					return true;
+				}
+			}
+			continue;
+		}
+
+		const WideBvhNode &node = nodes[next.offset];
+		float distances[MAX_CHILDREN];
+		intersectChildren(node, origin, inverseDirection, maxDistance, distances);
+		for (int child = MAX_CHILDREN - 1; child >= 0; child--) {
+			if (distances[child] == std::numeric_limits<float>::infinity()) continue;
+			stack[stackSize++] = {node.child[child], node.triangleCount[child], distances[child]};
+		}
+	}
+	return false;
+}
+
+// Depth first like the binary tree's traversal: a node's children that the ray hits go on the stack furthest
+// first, so the nearest is the next one taken off, and anything taken off that is further away than the closest
+// hit found since it went on is dropped without being looked at
+template <bool FirstHitWins>
+bool WideBvh::traverse(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance, BvhHit &hit) const {
+	if (nodes.empty()) return false;
+	glm::vec3 inverseDirection = 1.0f / direction;
+	float closest = maxDistance;
+	bool found = false;
+
+	Deferred stack[STACK_SIZE];
+	size_t stackSize = 0;
+	stack[stackSize++] = {0, 0, 0.0f};
+	while (stackSize != 0) {
+		Deferred next = stack[--stackSize];
+		if (next.distance >= closest) continue;
+
+		if (next.triangleCount != 0) {
+			uint32_t blockCount = (next.triangleCount + TriangleBlock::SIZE - 1) / TriangleBlock::SIZE;
+			for (uint32_t i = next.offset; i < next.offset + blockCount; i++) {
+				if (intersectTriangleBlock(blocks[i], origin, direction, closest, hit)) {
+					found = true;
+					closest = hit.distance;
+					if (FirstHitWins) return true;
+				}
+			}
+			continue;
+		}
+
+		const WideBvhNode &node = nodes[next.offset];
+		float distances[MAX_CHILDREN];
+		intersectChildren(node, origin, inverseDirection, closest, distances);
+		// insertion sort into furthest first order, straight onto the stack
+		size_t first = stackSize;
+		for (int child = 0; child < MAX_CHILDREN; child++) {
+			if (distances[child] == std::numeric_limits<float>::infinity()) continue;
+			Deferred entry = {node.child[child], node.triangleCount[child], distances[child]};
+			size_t slot = stackSize++;
+			while (slot > first && stack[slot - 1].distance < entry.distance) {
+				stack[slot] = stack[slot - 1];
+				slot--;
+			}
+			stack[slot] = entry;
+		}
+	}
+	return found;
+}
@@ -2,8 +2,22 @@
 #include <CanvasPoint.h>
 #include <Colour.h>
 #include <DrawingWindow.h>
+#include <OffscreenTarget.h>
+#include <DepthBuffer.h>
+#include <Simd.h>
+#include <ThreadPool.h>
 #include <TextureMap.h>
+#include <TextureCache.h>
+#include <ObjLoader.h>
+#include <MeshCache.h>
+#include <ImageWriter.h>
+#include <MaterialTable.h>
+#include <Mesh.h>
+#include <Bvh.h>
+#include <WideBvh.h>
+#include <TriangleBlock.h>
 #include <ModelTriangle.h>
+#include <RayTriangleIntersection.h>
 #include <Utils.h>
 #include <fstream>
 #include <vector>
@@ -11,6 +25,13 @@
 #include <glm/gtx/string_cast.hpp>
 
 #include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <stdexcept>
 
 #define WIDTH 320
 #define HEIGHT 240
@@ -18,6 +39,76 @@
 glm::vec3 g_camera_position(0.0, 0.0, 4.0);
 glm::mat3 g_camera_orientation = glm::mat3(1.0);
 
+enum class RasteriserBackend {
+    Scanline,
+    EdgeFunction
+};
+
+enum class RenderMode {
+    Rasterised,
+    RayTraced
+};
+
+RenderMode g_render_mode = RenderMode::Rasterised;
+RasteriserBackend g_rasteriser_backend = RasteriserBackend::Scanline;
+bool g_tiled_rendering = true;
+bool g_occlusion_culling = true;
+bool g_backface_culling = true;
+//  only the ray tracer casts shadows, and they're off to start with so that its image matches the rasteriser's
+bool g_shadows = false;
+TextureFilter g_texture_filter = TextureFilter::Trilinear;
+
+// Bumped by everything that changes what a frame looks like: the camera and every render setting. The scene itself
+// never changes once it is loaded. The window loop compares it with the version it last drew, so it only draws (and
+// presents) when there is something new to show.
+uint64_t g_view_version = 1;
+
+ThreadPool g_thread_pool;
+TextureCache g_texture_cache;
+//  saves screenshots off the render thread; declared after the pool and cache so it finishes writing before they go
+AsyncImageWriter g_image_writer;
+
+// inclusive range of pixels that a rasteriser is allowed to touch, either the whole canvas or a single screen tile
+struct PixelRect {
+    int min_x;
+    int min_y;
+    int max_x;
+    int max_y;
+};
+
+// work skipped by the rasterisers, counted per worker and summed into g_frame_stats at the end of a frame
+struct RasterCounters {
+    size_t triangles_occlusion_culled = 0;
+    size_t blocks_occlusion_culled = 0;
+};
+
+// triangles removed or split up by the geometry stage, counted per setup chunk
+struct GeometryCounters {
+    size_t triangles_backface_culled = 0;
+    size_t triangles_frustum_culled = 0;
+    size_t triangles_clipped = 0;
+    size_t triangles_emitted = 0;
+};
+
+struct FrameStats {
+    size_t triangles_submitted = 0;
+//  each vertex shared between triangles is only transformed once per frame
+    size_t vertices_transformed = 0;
+    GeometryCounters geometry;
+    size_t triangles_occlusion_culled = 0;
+//  in tiled mode a triangle is only counted as culled above if every tile it touches rejected it,
+//  so this counts each (triangle, tile) rejection separately
+    size_t tile_triangles_occlusion_culled = 0;
+    size_t blocks_occlusion_culled = 0;
+//  only counted when ray tracing
+    size_t rays_traced = 0;
+    size_t rays_hit = 0;
+    size_t shadow_rays_traced = 0;
+    size_t shadow_rays_occluded = 0;
+};
+
+FrameStats g_frame_stats;
+
 
 void draw(DrawingWindow &window) {
     window.clearPixels();
@@ -115,7 +206,9 @@ void drawLine(DrawingWindow &window, CanvasPoint from, CanvasPoint to, const Col
     }
 }
 
-void drawDepthLine(DrawingWindow &window, CanvasPoint from, CanvasPoint to, const Colour& colour, std::vector<std::vector<float>>& depth_vector) {
+// Draws one row of a filled triangle, from on the left to to on the right. Only the steps that land inside the clip
+// rectangle are taken, so that a tile pays for its own pixels and not for the whole row.
+void drawDepthLine(RenderTarget &target, CanvasPoint from, CanvasPoint to, uint32_t packed_colour, DepthBuffer& depth_buffer, const PixelRect& clip) {
     float dx = to.x - from.x;
     float dy = to.y - from.y;
     float d_depth = to.depth - from.depth;
@@ -124,21 +217,36 @@ void drawDepthLine(DrawingWindow &window, CanvasPoint from, CanvasPoint to, cons
     float steps = ceil(fmax(abs(dx), abs(dy)));
 
     float x_step_size = dx / steps;
-    float y_step_size = dy / steps;
     float depth_step_size = d_depth / steps;
 
-    uint32_t packed_colour = (255 << 24) + (int(colour.red) << 16) + (int(colour.green) << 8) + int(colour.blue);
+//  a zero length row has no steps to take (its step sizes are 0 / 0)
+    int y = int(round(from.y));
+    if (!(steps > 0) || y < clip.min_y || y > clip.max_y) return;
+
+//  Starts a step or so before the first one that rounds to clip.min_x, and stops after the last one that rounds to
+//  clip.max_x. Each step's x and depth are still worked out from its number, so a tile draws exactly the pixels that
+//  the whole row would have drawn in it.
+    int first_step = 0;
+    if (from.x < clip.min_x && x_step_size > 0) first_step = std::max(0, int(floor((clip.min_x - 0.5f - from.x) / x_step_size)) - 1);
+
+    float *depth_row = depth_buffer.row(y);
+    uint32_t *pixel_row = target.row(y);
+    int first_written = clip.max_x + 1;
+    int last_written = clip.min_x - 1;
+    for (int i = first_step; i <= steps; i++) {
+        int x = int(round(from.x + x_step_size * i));
+        if (x < clip.min_x) continue;
+        if (x > clip.max_x) break;
 
-    for (int i = 0; i <= steps; i++) {
         float current_depth = from.depth + depth_step_size * i;
-        float x = round(from.x + x_step_size * i);
-        float y = round(from.y + y_step_size * i);
-
-        if (current_depth > depth_vector[y][x]) {
-            window.setPixelColour(x, y, packed_colour);
-            depth_vector[y][x] = current_depth;
+        if (current_depth > depth_row[x]) {
+            pixel_row[x] = packed_colour;
+            depth_row[x] = current_depth;
+            first_written = std::min(first_written, x);
+            last_written = std::max(last_written, x);
         }
     }
+    if (first_written <= last_written) depth_buffer.markWritten(first_written, y, last_written);
 }
 
 void drawStrokedTriangle(DrawingWindow &window, CanvasTriangle triangle, Colour colour) {
@@ -170,19 +278,18 @@ CanvasPoint getTexturePixelGivenProportion(CanvasPoint start, CanvasPoint end, f
     return new_texture_point;
 }
 
+// the point is on the line, so the proportion along it is the same along either axis; the longer one is used so
+// that near vertical or horizontal lines don't divide by (almost) zero
 float getProportionAlongLineGivenPoint(CanvasPoint start, CanvasPoint end, CanvasPoint point) {
     float start_to_end_x = end.x - start.x;
     float start_to_end_y = end.y - start.y;
-    float start_end_magnitude = sqrt((start_to_end_x) * (start_to_end_x) + (start_to_end_y) * (start_to_end_y));
 
-    float start_to_point_x = point.x - start.x;
-    float start_to_point_y = point.y - start.y;
-    float start_point_magnitude = sqrt((start_to_point_x) * (start_to_point_x) + (start_to_point_y) * (start_to_point_y));
-
-    return start_point_magnitude / start_end_magnitude;
+    if (std::abs(start_to_end_x) > std::abs(start_to_end_y)) return (point.x - start.x) / start_to_end_x;
+    return (point.y - start.y) / start_to_end_y;
 }
 
-void drawFilledTriangle(DrawingWindow &window, CanvasTriangle triangle, const Colour& colour, std::vector<std::vector<float>>& depth_vector) {
+// packed_colour is 0xAARRGGBB, as it is written to the window
+void drawFilledTriangle(RenderTarget &target, CanvasTriangle triangle, uint32_t packed_colour, DepthBuffer& depth_buffer, const PixelRect& clip) {
     if (triangle.v1().y < triangle.v0().y) std::swap(triangle.v1(), triangle.v0());
     if (triangle.v2().y < triangle.v0().y) std::swap(triangle.v2(), triangle.v0());
     if (triangle.v2().y < triangle.v1().y) std::swap(triangle.v2(), triangle.v1());
@@ -192,7 +299,9 @@ void drawFilledTriangle(DrawingWindow &window, CanvasTriangle triangle, const Co
     float split_point_depth = triangle.v0().depth + proportion_split * (triangle.v2().depth - triangle.v0().depth);
     CanvasPoint split_point(split_point_x, triangle.v1().y, split_point_depth);
 
-    for (int y = int(ceil(triangle.v0().y)); y <= int(floor(triangle.v1().y)); y++) {
+    int first_row = std::max(int(ceil(triangle.v0().y)), clip.min_y);
+    int split_row = std::min(int(floor(triangle.v1().y)), clip.max_y);
+    for (int y = first_row; y <= split_row; y++) {
         float proportion_a = (y - triangle.v0().y) / (triangle.v1().y - triangle.v0().y);
         float x_a = triangle.v0().x + proportion_a * (triangle.v1().x - triangle.v0().x);
         float depth_a = triangle.v0().depth + proportion_a * (triangle.v1().depth - triangle.v0().depth);
@@ -206,10 +315,12 @@ void drawFilledTriangle(DrawingWindow &window, CanvasTriangle triangle, const Co
 
         if (from_a.x > from_b.x) std::swap(from_a, from_b);
 
-        drawDepthLine(window, from_a, from_b, colour, depth_vector);
+        drawDepthLine(target, from_a, from_b, packed_colour, depth_buffer, clip);
     }
 
-    for (int y = int(ceil(triangle.v1().y)); y <= int(floor(triangle.v2().y)); y++) {
+    int second_row = std::max(int(ceil(triangle.v1().y)), clip.min_y);
+    int last_row = std::min(int(floor(triangle.v2().y)), clip.max_y);
+    for (int y = second_row; y <= last_row; y++) {
         float proportion_a = (y - triangle.v1().y) / (triangle.v2().y - triangle.v1().y);
         float x_a = triangle.v1().x + proportion_a * (triangle.v2().x - triangle.v1().x);
         float depth_a = triangle.v1().depth + proportion_a * (triangle.v2().depth - triangle.v1().depth);
@@ -223,13 +334,323 @@ void drawFilledTriangle(DrawingWindow &window, CanvasTriangle triangle, const Co
 
         if (from_a.x > from_b.x) std::swap(from_a, from_b);
 
-        drawDepthLine(window, from_a, from_b, colour, depth_vector);
+        drawDepthLine(target, from_a, from_b, packed_colour, depth_buffer, clip);
+    }
+}
+
+
+// edge function of the directed edge a -> b, stored as w(x, y) = a_coefficient * x + b_coefficient * y + c_coefficient
+struct EdgeFunction {
+    float a_coefficient;
+    float b_coefficient;
+    float c_coefficient;
+//  pixels exactly on an edge are only filled for top and left edges, so shared edges are never drawn twice
+    float inside_threshold;
+
+    EdgeFunction(const CanvasPoint& a, const CanvasPoint& b) {
+        a_coefficient = a.y - b.y;
+        b_coefficient = b.x - a.x;
+        c_coefficient = a.x * b.y - a.y * b.x;
+
+//      with the winding the rasterisers use, inside is where the function increases, and y points down the screen:
+//      a top edge is horizontal with the inside below it, a left edge has the inside to its right
+        bool is_top_edge = a_coefficient == 0 && b_coefficient > 0;
+        bool is_left_edge = a_coefficient > 0;
+        inside_threshold = (is_top_edge || is_left_edge) ? 0.0f : std::numeric_limits<float>::min();
+    }
+
+    float evaluate(float x, float y) const {
+        return a_coefficient * x + b_coefficient * y + c_coefficient;
+    }
+
+//  largest value the edge function takes anywhere in a block, used to throw away blocks entirely outside the edge
+    float maximumOverBlock(float x, float y, float size) const {
+        return evaluate(x + (a_coefficient > 0 ? size : 0), y + (b_coefficient > 0 ? size : 0));
+    }
+
+    float minimumOverBlock(float x, float y, float size) const {
+        return evaluate(x + (a_coefficient > 0 ? 0 : size), y + (b_coefficient > 0 ? 0 : size));
+    }
+};
+
+// a value interpolated linearly across the screen, stored as value(x, y) = a * x + b * y + c
+struct ScreenPlane {
+    float a;
+    float b;
+    float c;
+
+    float evaluate(float x, float y) const {
+        return a * x + b * y + c;
+    }
+};
+
+// plane through the given per-vertex values, found by weighting each value by its barycentric edge function
+ScreenPlane interpolateAcrossTriangle(const CanvasTriangle& triangle, float v0_value, float v1_value, float v2_value) {
+    EdgeFunction edges[3] = {
+            EdgeFunction(triangle[1], triangle[2]),
+            EdgeFunction(triangle[2], triangle[0]),
+            EdgeFunction(triangle[0], triangle[1])
+    };
+    float values[3] = {v0_value, v1_value, v2_value};
+    float area = edges[0].evaluate(triangle[0].x, triangle[0].y);
+
+    ScreenPlane plane = {0, 0, 0};
+    if (area == 0) return plane;
+    for (int i = 0; i < 3; i++) {
+        plane.a += edges[i].a_coefficient * values[i] / area;
+        plane.b += edges[i].b_coefficient * values[i] / area;
+        plane.c += edges[i].c_coefficient * values[i] / area;
     }
+    return plane;
+}
+
+// blocks line up with the finest level of the depth hierarchy so that they can be occlusion culled one by one
+#define RASTER_BLOCK_SIZE DepthBuffer::BLOCK_SIZE
+
+// Walks the blocks and SIMD_LANES wide pixel runs of a triangle, doing coverage, occlusion culling and the depth
+// test, and leaves colouring the visible pixels to the shader. For every row of a block the shader gets
+// beginRow(x, y), then shade(x, y, visible, visible_lanes, depth) and step() for each run, so it can step its own
+// attributes the same way the edge functions are stepped. Everything the shader is asked to colour is inside the
+// clip rectangle, so it can write straight into the target's rows without any further checks.
+template<typename Shader>
+void rasteriseEdgeFunctionTriangle(CanvasTriangle triangle, Shader& shader, DepthBuffer& depth_buffer, const PixelRect& clip, RasterCounters& counters) {
+    for (const auto & vertex : triangle.vertices) {
+        if (!std::isfinite(vertex.x) || !std::isfinite(vertex.y) || !std::isfinite(vertex.depth)) return;
+    }
+
+    float area = EdgeFunction(triangle.v1(), triangle.v2()).evaluate(triangle.v0().x, triangle.v0().y);
+    if (area == 0) return;
+//  make the winding consistent so that inside always means all three edge functions are positive
+    if (area < 0) {
+        std::swap(triangle.v1(), triangle.v2());
+        area = -area;
+    }
+
+    EdgeFunction edges[3] = {
+            EdgeFunction(triangle.v1(), triangle.v2()),
+            EdgeFunction(triangle.v2(), triangle.v0()),
+            EdgeFunction(triangle.v0(), triangle.v1())
+    };
+
+//  depth (1/z) is linear in screen space, so it can be stepped exactly like the edge functions
+    ScreenPlane depth_plane = interpolateAcrossTriangle(triangle, triangle.v0().depth, triangle.v1().depth, triangle.v2().depth);
+    float depth_a = depth_plane.a, depth_b = depth_plane.b, depth_c = depth_plane.c;
+
+    float triangle_nearest = std::max({triangle.v0().depth, triangle.v1().depth, triangle.v2().depth});
+    float triangle_farthest = std::min({triangle.v0().depth, triangle.v1().depth, triangle.v2().depth});
+
+    int min_x = std::max(clip.min_x, int(ceil(std::min({triangle.v0().x, triangle.v1().x, triangle.v2().x}))));
+    int min_y = std::max(clip.min_y, int(ceil(std::min({triangle.v0().y, triangle.v1().y, triangle.v2().y}))));
+    int max_x = std::min(clip.max_x, int(floor(std::max({triangle.v0().x, triangle.v1().x, triangle.v2().x}))));
+    int max_y = std::min(clip.max_y, int(floor(std::max({triangle.v0().y, triangle.v1().y, triangle.v2().y}))));
+    if (min_x > max_x || min_y > max_y) return;
+
+    SimdFloat lane_offsets = simdLaneOffsets();
+    SimdFloat last_column = simdSet(float(max_x));
+    SimdFloat depth_lane_offsets = simdMul(lane_offsets, simdSet(depth_a));
+    SimdFloat depth_step = simdSet(depth_a * SIMD_LANES);
+    SimdFloat edge_lane_offsets[3];
+    SimdFloat edge_steps[3];
+    SimdFloat edge_thresholds[3];
+    for (int i = 0; i < 3; i++) {
+        edge_lane_offsets[i] = simdMul(lane_offsets, simdSet(edges[i].a_coefficient));
+        edge_steps[i] = simdSet(edges[i].a_coefficient * SIMD_LANES);
+        edge_thresholds[i] = simdSet(edges[i].inside_threshold);
+    }
+
+//  blocks are aligned to the block grid (and tiles are whole blocks), and rows of the depth buffer are padded to a
+//  multiple of 16 floats, so whole SIMD loads never run past the end of a depth row or into a neighbouring tile
+    for (int block_y = min_y - min_y % RASTER_BLOCK_SIZE; block_y <= max_y; block_y += RASTER_BLOCK_SIZE) {
+        for (int block_x = min_x - min_x % RASTER_BLOCK_SIZE; block_x <= max_x; block_x += RASTER_BLOCK_SIZE) {
+            bool outside = false;
+            bool fully_inside = true;
+            for (const auto & edge : edges) {
+                if (edge.maximumOverBlock(block_x, block_y, RASTER_BLOCK_SIZE - 1) < edge.inside_threshold) outside = true;
+                if (edge.minimumOverBlock(block_x, block_y, RASTER_BLOCK_SIZE - 1) < edge.inside_threshold) fully_inside = false;
+            }
+            if (outside) continue;
+
+            bool fully_visible = false;
+            if (g_occlusion_culling) {
+                int block_column = block_x / RASTER_BLOCK_SIZE;
+                int block_row = block_y / RASTER_BLOCK_SIZE;
+//              the depth plane is linear, so its extremes over the block are at two of the corners
+                float corner_depths[4] = {
+                        depth_a * block_x + depth_b * block_y + depth_c,
+                        depth_a * (block_x + RASTER_BLOCK_SIZE - 1) + depth_b * block_y + depth_c,
+                        depth_a * block_x + depth_b * (block_y + RASTER_BLOCK_SIZE - 1) + depth_c,
+                        depth_a * (block_x + RASTER_BLOCK_SIZE - 1) + depth_b * (block_y + RASTER_BLOCK_SIZE - 1) + depth_c
+                };
+                float block_nearest = std::min(triangle_nearest, *std::max_element(corner_depths, corner_depths + 4));
+                float block_farthest = std::max(triangle_farthest, *std::min_element(corner_depths, corner_depths + 4));
+                if (block_nearest < depth_buffer.farthestInBlock(block_column, block_row)) {
+                    counters.blocks_occlusion_culled++;
+                    continue;
+                }
+//              a fully covered block that is entirely in front of everything stored there needs no depth reads
+                fully_visible = fully_inside && block_farthest > depth_buffer.nearestInBlock(block_column, block_row);
+            }
+
+            int first_row = std::max(block_y, min_y);
+            int last_row = std::min(block_y + RASTER_BLOCK_SIZE - 1, max_y);
+
+            int last_column_in_block = std::min(block_x + RASTER_BLOCK_SIZE - 1, max_x);
+            bool block_written = false;
+//          every depth of a block the triangle covers completely goes through a register here, so its new extremes
+//          can be kept on the way rather than the hierarchy reading the whole block back afterwards
+            bool whole_block = g_occlusion_culling && fully_inside && block_x >= min_x && block_y >= min_y &&
+                               block_x + RASTER_BLOCK_SIZE - 1 <= max_x && block_y + RASTER_BLOCK_SIZE - 1 <= max_y;
+            SimdFloat new_farthest = simdSet(std::numeric_limits<float>::infinity());
+            SimdFloat new_nearest = simdSet(-std::numeric_limits<float>::infinity());
+
+            for (int y = first_row; y <= last_row; y++) {
+                float *depth_row = depth_buffer.row(y);
+
+                SimdFloat w[3];
+                for (int i = 0; i < 3; i++) w[i] = simdAdd(simdSet(edges[i].evaluate(block_x, y)), edge_lane_offsets[i]);
+                SimdFloat depth = simdAdd(simdSet(depth_a * block_x + depth_b * y + depth_c), depth_lane_offsets);
+                SimdFloat lane_x = simdAdd(simdSet(float(block_x)), lane_offsets);
+                shader.beginRow(block_x, y);
+
+                for (int x = block_x; x <= last_column_in_block; x += SIMD_LANES) {
+                    SimdMask covered = simdLessEqual(lane_x, last_column);
+                    if (!fully_inside) {
+                        for (int i = 0; i < 3; i++) covered = simdAnd(covered, simdGreaterEqual(w[i], edge_thresholds[i]));
+                    }
+
+                    if (simdMoveMask(covered) != 0) {
+                        SimdFloat stored_depth = simdLoad(depth_row + x);
+                        SimdMask visible = fully_visible ? covered : simdAnd(covered, simdGreater(depth, stored_depth));
+                        int visible_lanes = simdMoveMask(visible);
+
+                        SimdFloat new_depth = simdSelect(visible, depth, stored_depth);
+                        if (visible_lanes != 0) {
+                            simdStore(depth_row + x, new_depth);
+                            shader.shade(x, y, visible, visible_lanes, depth);
+                            block_written = true;
+                        }
+                        if (whole_block) {
+                            new_farthest = simdMin(new_farthest, new_depth);
+                            new_nearest = simdMax(new_nearest, new_depth);
+                        }
+                    }
+
+                    for (int i = 0; i < 3; i++) w[i] = simdAdd(w[i], edge_steps[i]);
+                    depth = simdAdd(depth, depth_step);
+                    lane_x = simdAdd(lane_x, simdSet(float(SIMD_LANES)));
+                    shader.step();
+                }
+            }
+            if (block_written && whole_block) {
+                float farthest_lanes[SIMD_LANES];
+                float nearest_lanes[SIMD_LANES];
+                simdStore(farthest_lanes, new_farthest);
+                simdStore(nearest_lanes, new_nearest);
+                depth_buffer.setBlockDepths(block_x / RASTER_BLOCK_SIZE, block_y / RASTER_BLOCK_SIZE, *std::min_element(farthest_lanes, farthest_lanes + SIMD_LANES),
+                                            *std::max_element(nearest_lanes, nearest_lanes + SIMD_LANES));
+            } else if (block_written) {
+                depth_buffer.markWritten(block_x, block_y, block_x);
+            }
+        }
+    }
+}
+
+struct FlatColourShader {
+    RenderTarget &target;
+    SimdInt packed_colour;
+
+    void beginRow(int x, int y) {}
+
+    void shade(int x, int y, SimdMask visible, int visible_lanes, SimdFloat depth) {
+        target.storeMasked(x, y, visible, packed_colour);
+    }
+
+    void step() {}
+};
+
+// Perspective-correct texturing: u and v aren't linear in screen space but u/z, v/z and 1/z are, so those are
+// stepped along the row and divided back out per pixel. The depth buffer already holds 1/z, so the rasteriser's
+// depth vector doubles as the divisor.
+// The mip level comes from the screen space derivatives of u and v. By the quotient rule on u = (u/z) / (1/z),
+// du/dx = (d(u/z)/dx - u * d(1/z)/dx) / (1/z), and all of the d/dx terms are just the x coefficients of the planes.
+struct PerspectiveTextureShader {
+    RenderTarget &target;
+    const TextureMap &texture;
+    TextureFilter filter;
+    ScreenPlane u_over_z_plane;
+    ScreenPlane v_over_z_plane;
+    ScreenPlane depth_plane;
+    SimdFloat u_over_z_lane_offsets;
+    SimdFloat v_over_z_lane_offsets;
+    SimdFloat u_over_z_step;
+    SimdFloat v_over_z_step;
+    SimdFloat u_over_z;
+    SimdFloat v_over_z;
+
+    PerspectiveTextureShader(RenderTarget &target, const TextureMap &texture, TextureFilter filter, const CanvasTriangle& triangle) : target(target), texture(texture), filter(filter) {
+        depth_plane = interpolateAcrossTriangle(triangle, triangle[0].depth, triangle[1].depth, triangle[2].depth);
+        u_over_z_plane = interpolateAcrossTriangle(triangle,
+                triangle[0].texturePoint.x * triangle[0].depth,
+                triangle[1].texturePoint.x * triangle[1].depth,
+                triangle[2].texturePoint.x * triangle[2].depth);
+        v_over_z_plane = interpolateAcrossTriangle(triangle,
+                triangle[0].texturePoint.y * triangle[0].depth,
+                triangle[1].texturePoint.y * triangle[1].depth,
+                triangle[2].texturePoint.y * triangle[2].depth);
+        u_over_z_lane_offsets = simdMul(simdLaneOffsets(), simdSet(u_over_z_plane.a));
+        v_over_z_lane_offsets = simdMul(simdLaneOffsets(), simdSet(v_over_z_plane.a));
+        u_over_z_step = simdSet(u_over_z_plane.a * SIMD_LANES);
+        v_over_z_step = simdSet(v_over_z_plane.a * SIMD_LANES);
+        u_over_z = v_over_z = simdSet(0);
+    }
+
+    void beginRow(int x, int y) {
+        u_over_z = simdAdd(simdSet(u_over_z_plane.evaluate(x, y)), u_over_z_lane_offsets);
+        v_over_z = simdAdd(simdSet(v_over_z_plane.evaluate(x, y)), v_over_z_lane_offsets);
+    }
+
+    void shade(int x, int y, SimdMask visible, int visible_lanes, SimdFloat depth) {
+        SimdFloat lane_u = simdDiv(u_over_z, depth);
+        SimdFloat lane_v = simdDiv(v_over_z, depth);
+        float u[SIMD_LANES], v[SIMD_LANES];
+        float dudx[SIMD_LANES], dvdx[SIMD_LANES], dudy[SIMD_LANES], dvdy[SIMD_LANES];
+        simdStore(u, lane_u);
+        simdStore(v, lane_v);
+        simdStore(dudx, simdDiv(simdSub(simdSet(u_over_z_plane.a), simdMul(lane_u, simdSet(depth_plane.a))), depth));
+        simdStore(dvdx, simdDiv(simdSub(simdSet(v_over_z_plane.a), simdMul(lane_v, simdSet(depth_plane.a))), depth));
+        simdStore(dudy, simdDiv(simdSub(simdSet(u_over_z_plane.b), simdMul(lane_u, simdSet(depth_plane.b))), depth));
+        simdStore(dvdy, simdDiv(simdSub(simdSet(v_over_z_plane.b), simdMul(lane_v, simdSet(depth_plane.b))), depth));
+
+        uint32_t colours[SIMD_LANES] = {};
+        for (int lane = 0; lane < SIMD_LANES; lane++) {
+            if (visible_lanes & (1 << lane)) {
+                float lod = texture.levelOfDetail(dudx[lane], dvdx[lane], dudy[lane], dvdy[lane]);
+                colours[lane] = texture.sample(u[lane], v[lane], lod, filter);
+            }
+        }
+        target.storeMasked(x, y, visible, simdLoadInt(colours));
+    }
+
+    void step() {
+        u_over_z = simdAdd(u_over_z, u_over_z_step);
+        v_over_z = simdAdd(v_over_z, v_over_z_step);
+    }
+};
+
+void drawEdgeFunctionTriangle(RenderTarget &target, const CanvasTriangle& triangle, uint32_t packed_colour, DepthBuffer& depth_buffer, const PixelRect& clip, RasterCounters& counters) {
+    FlatColourShader shader = {target, simdSetInt(packed_colour)};
+    rasteriseEdgeFunctionTriangle(triangle, shader, depth_buffer, clip, counters);
+}
+
+// texture points are in [0, 1] across the texture, as they come out of the obj file
+void drawPerspectiveTexturedTriangle(RenderTarget &target, const CanvasTriangle& triangle, const TextureMap& texture, DepthBuffer& depth_buffer, const PixelRect& clip, RasterCounters& counters) {
+    PerspectiveTextureShader shader(target, texture, g_texture_filter, triangle);
+    rasteriseEdgeFunctionTriangle(triangle, shader, depth_buffer, clip, counters);
 }
 
 
 void drawTexturedTriangle(DrawingWindow &window, CanvasTriangle canvas_triangle, const std::string& file_path) {
-    TextureMap texture_map = TextureMap(file_path);
+    const TextureMap &texture_map = g_texture_cache.get(file_path);
 
 //    sort canvas and find split point
     if (canvas_triangle.v1().y < canvas_triangle.v0().y) std::swap(canvas_triangle.v1(), canvas_triangle.v0());
@@ -270,7 +691,7 @@ void drawTexturedTriangle(DrawingWindow &window, CanvasTriangle canvas_triangle,
                 float proportion = (x - x_a) / (x_b - x_a);
                 CanvasPoint texture_point = getTexturePixelGivenProportion(point_on_texture_a, point_on_texture_b, proportion);
 
-                uint32_t texture_colour = texture_map.pixels[int(texture_point.texturePoint.y) * texture_map.width + int(texture_point.texturePoint.x)];
+                uint32_t texture_colour = texture_map.texel(size_t(texture_point.texturePoint.x), size_t(texture_point.texturePoint.y));
                 window.setPixelColour(x, y, texture_colour);
             }
 
@@ -294,7 +715,7 @@ void drawTexturedTriangle(DrawingWindow &window, CanvasTriangle canvas_triangle,
                 float proportion = (x - x_a) / (x_b - x_a);
                 CanvasPoint texture_point = getTexturePixelGivenProportion(point_on_texture_a, point_on_texture_b, proportion);
 
-                uint32_t texture_colour = texture_map.pixels[int(texture_point.texturePoint.y) * texture_map.width + int(texture_point.texturePoint.x)];
+                uint32_t texture_colour = texture_map.texel(size_t(texture_point.texturePoint.x), size_t(texture_point.texturePoint.y));
                 window.setPixelColour(x, y, texture_colour);
             }
         }
@@ -302,112 +723,863 @@ void drawTexturedTriangle(DrawingWindow &window, CanvasTriangle canvas_triangle,
 
 }
 
-std::unordered_map<std::string, Colour> parsePaletteMtlFile(const std::string& file_name) {
+// what drawScene draws: an indexed mesh whose triangles refer to materials by their index in `materials`, the
+// BVH over the same triangles (collapsed into a 4-wide one) that the ray tracer uses instead of the mesh, and the
+// point lights that the ray tracer casts shadows from
+struct Scene {
+    Mesh mesh;
+    MaterialTable materials;
+    WideBvh bvh;
+    std::vector<glm::vec3> lights;
+};
+
+Aabb meshBounds(const Mesh& mesh) {
+    Aabb bounds;
+    for (size_t vertex = 0; vertex < mesh.vertexCount(); vertex++) bounds.grow(mesh.position(vertex));
+    return bounds;
+}
+
+void printBvhStats(const BvhBuildStats& stats) {
+    std::cout << "BVH: " << stats.nodeCount << " nodes (" << stats.leafCount << " leaves, at most "
+              << stats.maxLeafTriangles << " triangles each), " << stats.maxDepth << " deep, SAH cost "
+              << stats.sahCost << ", built in " << stats.milliseconds << " ms" << std::endl;
+}
+
+// the acceleration structure type that loadScene stores in mesh caches
+#define WIDE_BVH_CACHE_TYPE 1
+
+Scene loadScene(const std::string& file_name, float scaling_factor, size_t bvh_leaf_size = BvhBuildOptions().maxLeafTriangles) {
+//  the binary cache next to the obj file is used whenever it is up to date, and (re)written whenever it isn't
+    MeshCache mesh_cache;
+    ObjModel loaded_model;
+    ObjModelView model;
+    if (mesh_cache.open(file_name)) {
+        model = mesh_cache.view();
+    } else {
+        loaded_model = loadObjFile(file_name, &g_thread_pool);
+        model = viewOf(loaded_model);
+    }
+
+//  decoding a texture (and building its mip chain) is by far the slowest part of loading a small model, so every
+//  texture the model uses is loaded up front, with different files decoded in parallel
+    std::vector<std::string> texture_files;
+    for (const auto & obj_material : model.materials) {
+        if (!obj_material.diffuseTexture.empty()) texture_files.push_back(obj_material.diffuseTexture);
+    }
+    g_texture_cache.preload(texture_files, &g_thread_pool);
+
+    Scene scene;
+//  obj material i is added as material i, so the table can be indexed by the obj's material numbers
+    for (const auto & obj_material : model.materials) {
+//      loaded through the cache, so materials (and models) sharing a texture file share one copy of it
+        const TextureMap *texture = obj_material.diffuseTexture.empty() ? nullptr : &g_texture_cache.get(obj_material.diffuseTexture);
+        scene.materials.add(obj_material.name, obj_material.diffuse, texture);
+    }
+
+//  faces like "f 1/ 2/ 3/" have no texture points, so they stay flat coloured even with a textured material: they
+//  get an untextured copy of it, made the first time it is needed, as does anything drawn before the first usemtl
+    std::vector<int> untextured_materials(model.materials.size(), -1);
+    int no_material = -1;
+    auto materialFor = [&](uint32_t obj_material, bool has_texture_points) {
+        if (obj_material == ObjTriangle::NO_INDEX) {
+            if (no_material < 0) no_material = scene.materials.add("", glm::vec3(0));
+            return MaterialIndex(no_material);
+        }
+        if (has_texture_points || !scene.materials[obj_material].hasFlag(MATERIAL_TEXTURED)) return MaterialIndex(obj_material);
+        if (untextured_materials[obj_material] < 0) {
+            untextured_materials[obj_material] = scene.materials.add(model.materials[obj_material].name, model.materials[obj_material].diffuse);
+        }
+        return MaterialIndex(untextured_materials[obj_material]);
+    };
+
+    scene.mesh = buildMesh(model, scaling_factor, materialFor);
+
+//  The collapsed BVH is cached with the model. It holds scaled copies of the triangles, in leaves of up to the
+//  leaf size, so one built with either of those different is of no use.
+    uint32_t scale_bits;
+    std::memcpy(&scale_bits, &scaling_factor, sizeof(scale_bits));
+    uint64_t bvh_key = uint64_t(scale_bits) << 32 | uint32_t(bvh_leaf_size);
+    ArrayView<uint8_t> cached_bvh = mesh_cache.accelerationStructure(WIDE_BVH_CACHE_TYPE, WideBvh::FORMAT_VERSION);
+    if (!cached_bvh.empty() && scene.bvh.deserialise(cached_bvh, bvh_key, scene.mesh.triangleCount())) {
+        std::cout << "BVH: " << scene.bvh.getNodes().size() << " " << WideBvh::MAX_CHILDREN << "-wide nodes loaded from the mesh cache" << std::endl;
+    } else {
+        BvhBuildOptions bvh_options;
+        bvh_options.maxLeafTriangles = bvh_leaf_size;
+        bvh_options.trianglesPerTest = TriangleBlock::SIZE;
+        bvh_options.pool = &g_thread_pool;
+        Bvh binary_bvh(scene.mesh, bvh_options);
+        printBvhStats(binary_bvh.stats());
+        scene.bvh = WideBvh(binary_bvh);
+        std::cout << "collapsed into " << scene.bvh.getNodes().size() << " " << WideBvh::MAX_CHILDREN << "-wide nodes ("
+                  << scene.bvh.getNodes().size() * sizeof(WideBvhNode) / 1024 << " KiB, down from "
+                  << binary_bvh.getNodes().size() * sizeof(BvhNode) / 1024 << " KiB)" << std::endl;
+
+//      a cache that was opened only needs its BVH replacing; the model it maps stays readable while that happens
+        std::vector<uint8_t> bvh_bytes = scene.bvh.serialise(bvh_key);
+        bool written = mesh_cache.isOpen() ? mesh_cache.rewrite(file_name, bvh_bytes, WIDE_BVH_CACHE_TYPE, WideBvh::FORMAT_VERSION)
+                                           : MeshCache::write(file_name, loaded_model, bvh_bytes, WIDE_BVH_CACHE_TYPE, WideBvh::FORMAT_VERSION);
+        if (!written) std::cout << "COULDN'T WRITE MESH CACHE FOR " << file_name << std::endl;
+    }
+
+//  obj files don't say where the lights are, so there is one just under the middle of the top of the scene, which
+//  for the Cornell box is where its ceiling light is
+    if (scene.mesh.vertexCount() != 0) {
+        Aabb bounds = meshBounds(scene.mesh);
+        glm::vec3 size = bounds.max - bounds.min;
+        scene.lights.push_back(glm::vec3((bounds.min.x + bounds.max.x) / 2, bounds.max.y - size.y * 0.05f, (bounds.min.z + bounds.max.z) / 2));
+    }
+    return scene;
+}
+
+#define FOCAL_LENGTH 2.0f
+#define IMAGE_PLANE_SCALE 160.0f
 
-    std::unordered_map<std::string, Colour> parsed_palette;
+// IMAGE_PLANE_SCALE is in pixels for a canvas HEIGHT pixels tall, and grows with the canvas so that every
+// resolution sees the same vertical field of view
+float imagePlaneScale(float canvas_height) {
+    return IMAGE_PLANE_SCALE * (canvas_height / HEIGHT);
+}
 
-    std::ifstream input_stream(file_name);
-    std::string next_line;
+// the camera looks down -z, so adjusted_vector.z must be negative (and not too close to zero) for this to make sense
+CanvasPoint projectCameraSpaceVertex(glm::vec3 adjusted_vector, float focal_length, float canvas_width, float canvas_height) {
+    float scale = imagePlaneScale(canvas_height);
+    float u = -focal_length * (adjusted_vector.x / adjusted_vector.z) * scale + canvas_width / 2;
+    float v = focal_length * (adjusted_vector.y / adjusted_vector.z) * scale + canvas_height / 2;
+    float depth = -1 / adjusted_vector.z;
 
+    CanvasPoint projected_vertex(u, v);
+    projected_vertex.depth = depth;
 
-    while (std::getline(input_stream, next_line)) {
-        if (!next_line.empty()) {
-            std::vector<std::string> parsed_line = split(next_line, ' ');
-            if (parsed_line[0][0] == 'n') { //n for newmtl
-                std::string colour_key = parsed_line[1];
+    return projected_vertex;
+}
 
-                std::getline(input_stream, next_line);
-                std::vector<std::string> parsed_rgb_line = split(next_line, ' ');
+CanvasPoint projectVertexOntoCanvasPoint(glm::vec3 camera_position, float focal_length, glm::vec3 vertex_position, glm::mat3 camera_orientation, float canvas_width = WIDTH, float canvas_height = HEIGHT) {
+    glm::vec3 camera_to_vertex = vertex_position - camera_position;
+    glm::vec3 adjusted_vector = camera_to_vertex * camera_orientation;
+
+    return projectCameraSpaceVertex(adjusted_vector, focal_length, canvas_width, canvas_height);
+}
+
+#define NEAR_PLANE_DISTANCE 0.01f
+// how far (in pixels) triangles may hang off each side of the canvas before they are clipped rather than just
+// left to the rasteriser's bounding box clamp, which keeps edge function values well inside float precision
+#define GUARD_BAND_PIXELS 2048.0f
+#define MAX_CLIPPED_VERTICES 9
+
+// planes in camera space, with a point p inside a plane when dot(plane, vec4(p, 1)) >= 0
+struct ViewFrustum {
+    glm::vec4 near_plane;
+    std::array<glm::vec4, 4> screen_planes;
+    std::array<glm::vec4, 4> guard_band_planes;
+//  size of the canvas the planes were made for, which is also what vertices get projected onto
+    float canvas_width;
+    float canvas_height;
+};
+
+// the side planes follow from u and v staying in range: after multiplying through by -z (which is positive in
+// front of the camera), -s * x / z + w / 2 >= -g becomes s * x - (w / 2 + g) * z >= 0 and so on
+ViewFrustum makeViewFrustum(float width, float height, float focal_length) {
+    float s = focal_length * imagePlaneScale(height);
+    auto side_planes = [&](float margin) {
+        return std::array<glm::vec4, 4>{{
+                glm::vec4(s, 0, -(width / 2 + margin), 0),
+                glm::vec4(-s, 0, -(width / 2 + margin), 0),
+                glm::vec4(0, -s, -(height / 2 + margin), 0),
+                glm::vec4(0, s, -(height / 2 + margin), 0)
+        }};
+    };
+
+    ViewFrustum frustum;
+    frustum.near_plane = glm::vec4(0, 0, -1, -NEAR_PLANE_DISTANCE);
+    frustum.screen_planes = side_planes(0);
+    frustum.guard_band_planes = side_planes(GUARD_BAND_PIXELS);
+    frustum.canvas_width = width;
+    frustum.canvas_height = height;
+    return frustum;
+}
 
-                int red = int(round(std::stof(parsed_rgb_line[1]) * 255));
-                int green = int(round(std::stof(parsed_rgb_line[2]) * 255));
-                int blue = int(round(std::stof(parsed_rgb_line[3]) * 255));
+float distanceToPlane(const glm::vec4& plane, const glm::vec3& point) {
+    return glm::dot(plane, glm::vec4(point, 1));
+}
 
-                Colour colour_value(red, green, blue);
+struct ClipVertex {
+    glm::vec3 position;
+    TexturePoint texture_point;
+};
+
+// one Sutherland-Hodgman pass: keeps the part of the polygon on the inside of the plane
+int clipPolygonAgainstPlane(const ClipVertex* input, int input_count, const glm::vec4& plane, ClipVertex* output) {
+    int output_count = 0;
+    for (int i = 0; i < input_count; i++) {
+        const ClipVertex &current = input[i];
+        const ClipVertex &next = input[(i + 1) % input_count];
+        float current_distance = distanceToPlane(plane, current.position);
+        float next_distance = distanceToPlane(plane, next.position);
+
+        if (current_distance >= 0) output[output_count++] = current;
+        if ((current_distance >= 0) != (next_distance >= 0)) {
+            float proportion = current_distance / (current_distance - next_distance);
+            ClipVertex &crossing = output[output_count++];
+            crossing.position = current.position + proportion * (next.position - current.position);
+            crossing.texture_point = TexturePoint(
+                    current.texture_point.x + proportion * (next.texture_point.x - current.texture_point.x),
+                    current.texture_point.y + proportion * (next.texture_point.y - current.texture_point.y));
+        }
+    }
+    return output_count;
+}
 
-                parsed_palette[colour_key] = colour_value;
+// bits of a vertex outcode, set for each frustum plane the vertex is outside of
+#define OUTSIDE_NEAR_PLANE 1u
+#define OUTSIDE_SCREEN_PLANES (0xFu << 1)
+#define OUTSIDE_GUARD_BAND_PLANES (0xFu << 5)
+
+// every vertex of the mesh after this frame's camera transform, so that a vertex shared by several triangles is
+// only transformed, projected and classified against the frustum once
+struct TransformedVertices {
+    std::vector<glm::vec3> camera_positions;
+//  only meaningful for vertices in front of the near plane
+    std::vector<CanvasPoint> projected;
+    std::vector<uint16_t> outcodes;
+};
+
+TransformedVertices g_transformed_vertices;
+
+#define VERTICES_PER_TRANSFORM_CHUNK 4096
+
+void transformVertices(const Mesh& mesh, const ViewFrustum& frustum, TransformedVertices& transformed) {
+    size_t vertex_count = mesh.vertexCount();
+    transformed.camera_positions.resize(vertex_count);
+    transformed.projected.resize(vertex_count);
+    transformed.outcodes.resize(vertex_count);
+
+    size_t chunk_count = (vertex_count + VERTICES_PER_TRANSFORM_CHUNK - 1) / VERTICES_PER_TRANSFORM_CHUNK;
+    g_thread_pool.parallelFor(chunk_count, [&](size_t chunk) {
+        size_t first = chunk * VERTICES_PER_TRANSFORM_CHUNK;
+        size_t last = std::min(first + VERTICES_PER_TRANSFORM_CHUNK, vertex_count);
+        for (size_t i = first; i < last; i++) {
+            glm::vec3 camera_position = (mesh.position(uint32_t(i)) - g_camera_position) * g_camera_orientation;
+            uint16_t outcode = 0;
+            if (distanceToPlane(frustum.near_plane, camera_position) < 0) outcode |= OUTSIDE_NEAR_PLANE;
+            for (int plane = 0; plane < 4; plane++) {
+                if (distanceToPlane(frustum.screen_planes[plane], camera_position) < 0) outcode |= 1u << (1 + plane);
+                if (distanceToPlane(frustum.guard_band_planes[plane], camera_position) < 0) outcode |= 1u << (5 + plane);
             }
+            transformed.camera_positions[i] = camera_position;
+            transformed.projected[i] = projectCameraSpaceVertex(camera_position, FOCAL_LENGTH, frustum.canvas_width, frustum.canvas_height);
+            transformed.outcodes[i] = outcode;
+        }
+    });
+}
+
+// the geometry stage: rejects back-facing and off-screen triangles, clips against the near plane (and the guard
+// band, when a triangle reaches past it) and projects what is left. Returns how many canvas triangles were written.
+int setupTriangle(const Mesh& mesh, const TransformedVertices& transformed, size_t triangle_index, const ViewFrustum& frustum, CanvasTriangle* output, GeometryCounters& counters) {
+    const uint32_t *indices = &mesh.indices[triangle_index * 3];
+    const glm::vec3 &p0 = transformed.camera_positions[indices[0]];
+    const glm::vec3 &p1 = transformed.camera_positions[indices[1]];
+    const glm::vec3 &p2 = transformed.camera_positions[indices[2]];
+
+//  the camera sits at the origin of camera space, so a triangle faces it when its normal points back towards it
+    if (g_backface_culling) {
+        glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+        if (glm::dot(normal, p0) >= 0) {
+            counters.triangles_backface_culled++;
+            return 0;
+        }
+    }
+
+    unsigned outside_all = transformed.outcodes[indices[0]] & transformed.outcodes[indices[1]] & transformed.outcodes[indices[2]];
+    unsigned outside_any = transformed.outcodes[indices[0]] | transformed.outcodes[indices[1]] | transformed.outcodes[indices[2]];
+    if (outside_all & (OUTSIDE_NEAR_PLANE | OUTSIDE_SCREEN_PLANES)) {
+        counters.triangles_frustum_culled++;
+        return 0;
+    }
+
+//  the common case: nothing to clip, so the vertices projected by transformVertices can be used as they are
+    if (!(outside_any & (OUTSIDE_NEAR_PLANE | OUTSIDE_GUARD_BAND_PLANES))) {
+        CanvasPoint corners[3];
+        for (int i = 0; i < 3; i++) {
+            corners[i] = transformed.projected[indices[i]];
+            corners[i].texturePoint = TexturePoint(mesh.textureU[indices[i]], mesh.textureV[indices[i]]);
         }
+        output[0] = CanvasTriangle(corners[0], corners[1], corners[2]);
+        counters.triangles_emitted++;
+        return 1;
     }
 
-    return parsed_palette;
+    ClipVertex polygon[MAX_CLIPPED_VERTICES];
+    for (int i = 0; i < 3; i++) {
+        polygon[i].position = transformed.camera_positions[indices[i]];
+        polygon[i].texture_point = TexturePoint(mesh.textureU[indices[i]], mesh.textureV[indices[i]]);
+    }
+
+    auto crossesPlane = [&](const glm::vec4& plane) {
+        return distanceToPlane(plane, polygon[0].position) < 0 || distanceToPlane(plane, polygon[1].position) < 0 || distanceToPlane(plane, polygon[2].position) < 0;
+    };
+
+    int vertex_count = 3;
+    ClipVertex clipped[MAX_CLIPPED_VERTICES];
+    bool was_clipped = false;
+    auto clipAgainst = [&](const glm::vec4& plane) {
+        if (vertex_count < 3 || !crossesPlane(plane)) return;
+        vertex_count = clipPolygonAgainstPlane(polygon, vertex_count, plane, clipped);
+        std::copy(clipped, clipped + vertex_count, polygon);
+        was_clipped = true;
+    };
+//  which guard band planes need clipping against is decided by the original three vertices, which is
+//  conservative: if none of them is outside a plane then nothing produced by clipping against another plane can be
+    if (outside_any & OUTSIDE_NEAR_PLANE) clipAgainst(frustum.near_plane);
+    for (int i = 0; i < 4; i++) {
+        if (outside_any & (1u << (5 + i))) clipAgainst(frustum.guard_band_planes[i]);
+    }
+    if (vertex_count < 3) {
+        counters.triangles_frustum_culled++;
+        return 0;
+    }
+    if (was_clipped) counters.triangles_clipped++;
+
+    CanvasPoint projected[MAX_CLIPPED_VERTICES];
+    for (int i = 0; i < vertex_count; i++) {
+        projected[i] = projectCameraSpaceVertex(polygon[i].position, FOCAL_LENGTH, frustum.canvas_width, frustum.canvas_height);
+        projected[i].texturePoint = polygon[i].texture_point;
+    }
+//  clipping a triangle against convex planes always leaves a convex polygon, so a fan covers it
+    for (int i = 1; i + 1 < vertex_count; i++) {
+        output[i - 1] = CanvasTriangle(projected[0], projected[i], projected[i + 1]);
+    }
+    counters.triangles_emitted += vertex_count - 2;
+    return vertex_count - 2;
 }
 
-std::vector<ModelTriangle> parseModelObjFile(const std::string& file_name, float scaling_factor) {
-    std::unordered_map<std::string, Colour> parsed_palette = parsePaletteMtlFile("cornell-box.mtl");
+// pixels a triangle can touch, padded by one pixel because the scanline rasteriser rounds to the nearest pixel
+PixelRect getTriangleBounds(const CanvasTriangle& canvas_triangle, const PixelRect& clip) {
+    float min_x = std::min({canvas_triangle[0].x, canvas_triangle[1].x, canvas_triangle[2].x});
+    float min_y = std::min({canvas_triangle[0].y, canvas_triangle[1].y, canvas_triangle[2].y});
+    float max_x = std::max({canvas_triangle[0].x, canvas_triangle[1].x, canvas_triangle[2].x});
+    float max_y = std::max({canvas_triangle[0].y, canvas_triangle[1].y, canvas_triangle[2].y});
+
+    float left = std::max(std::floor(min_x) - 1, float(clip.min_x));
+    float top = std::max(std::floor(min_y) - 1, float(clip.min_y));
+    float right = std::min(std::ceil(max_x) + 1, float(clip.max_x));
+    float bottom = std::min(std::ceil(max_y) + 1, float(clip.max_y));
+//  also rejects triangles with NaN coordinates, as every comparison with NaN is false
+    if (!(left <= right && top <= bottom)) return {0, 0, -1, -1};
+
+    return {int(left), int(top), int(right), int(bottom)};
+}
 
-    std::vector<ModelTriangle> parsed_model_triangles;
+void drawTriangle(RenderTarget &target, const CanvasTriangle& canvas_triangle, const Material& material, DepthBuffer& depth_buffer, const PixelRect& clip, RasterCounters& counters) {
+    PixelRect bounds = getTriangleBounds(canvas_triangle, clip);
+    if (bounds.min_x > bounds.max_x || bounds.min_y > bounds.max_y) return;
 
-    std::vector<glm::vec3> vertex_tracker;
+    if (g_occlusion_culling) {
+        float nearest = std::max({canvas_triangle[0].depth, canvas_triangle[1].depth, canvas_triangle[2].depth});
+        if (depth_buffer.isOccluded(bounds.min_x, bounds.min_y, bounds.max_x, bounds.max_y, nearest)) {
+            counters.triangles_occlusion_culled++;
+            return;
+        }
+    }
 
-    std::ifstream input_stream(file_name);
-    std::string next_line;
+//  there is only an edge function version of the textured rasteriser, so textured triangles use it on either backend
+    if (material.hasFlag(MATERIAL_TEXTURED)) {
+        drawPerspectiveTexturedTriangle(target, canvas_triangle, *material.texture, depth_buffer, clip, counters);
+    } else if (g_rasteriser_backend == RasteriserBackend::EdgeFunction) {
+        drawEdgeFunctionTriangle(target, canvas_triangle, material.argb, depth_buffer, clip, counters);
+    } else {
+        drawFilledTriangle(target, canvas_triangle, material.argb, depth_buffer, clip);
+    }
 
-    std::string current_colour;
+    if (g_occlusion_culling) depth_buffer.updateHierarchy(bounds.min_x, bounds.min_y, bounds.max_x, bounds.max_y);
+}
 
-    while (std::getline(input_stream, next_line)) {
-        if (!next_line.empty()) {
-            std::vector<std::string> parsed_line = split(next_line, ' ');
+#define SCREEN_TILE_SIZE 64
+static_assert(SCREEN_TILE_SIZE % DepthBuffer::TILE_SIZE == 0, "screen tiles must own whole tiles of the depth hierarchy");
+#define TRIANGLES_PER_SETUP_CHUNK 1024
+
+// a triangle that made it through the geometry stage, ready to be rasterised
+struct SetupTriangle {
+    CanvasTriangle canvas_triangle;
+    uint32_t model_index;
+    uint32_t tiles_touched;
+};
+
+// per-frame state of the tiled pipeline, kept between frames so that the bins only allocate while they grow
+struct TiledFrame {
+//  setup_triangles[chunk] holds what the geometry stage made of one chunk of the model, in model order
+    std::vector<std::vector<SetupTriangle>> setup_triangles;
+//  bins[chunk][tile] indexes into setup_triangles[chunk] for every triangle that touches the tile
+    std::vector<std::vector<std::vector<uint32_t>>> bins;
+    std::vector<GeometryCounters> chunk_counters;
+//  occlusion_culled[tile] holds the (chunk, index) of every setup triangle the tile rejected
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> occlusion_culled;
+    std::vector<RasterCounters> tile_counters;
+};
+
+TiledFrame g_tiled_frame;
+
+// sort-middle rendering: triangles are projected and binned into screen tiles in parallel, then every tile is
+// rasterised by one worker which is the only thread that ever writes to that tile's pixels and depths
+void drawSceneTiled(RenderTarget &target, const Scene& scene, const ViewFrustum& frustum) {
+    int tiles_across = int((target.width + SCREEN_TILE_SIZE - 1) / SCREEN_TILE_SIZE);
+    int tiles_down = int((target.height + SCREEN_TILE_SIZE - 1) / SCREEN_TILE_SIZE);
+    size_t tile_count = size_t(tiles_across) * tiles_down;
+    size_t triangle_count = scene.mesh.triangleCount();
+    size_t chunk_count = (triangle_count + TRIANGLES_PER_SETUP_CHUNK - 1) / TRIANGLES_PER_SETUP_CHUNK;
+
+    TiledFrame &frame = g_tiled_frame;
+    if (frame.setup_triangles.size() < chunk_count) frame.setup_triangles.resize(chunk_count);
+    if (frame.bins.size() < chunk_count) frame.bins.resize(chunk_count);
+    frame.chunk_counters.assign(chunk_count, GeometryCounters());
+    frame.occlusion_culled.resize(tile_count);
+    frame.tile_counters.assign(tile_count, RasterCounters());
+    PixelRect whole_canvas = {0, 0, int(target.width) - 1, int(target.height) - 1};
+
+    g_thread_pool.parallelFor(chunk_count, [&](size_t chunk) {
+        std::vector<SetupTriangle> &chunk_triangles = frame.setup_triangles[chunk];
+        std::vector<std::vector<uint32_t>> &chunk_bins = frame.bins[chunk];
+        chunk_triangles.clear();
+        chunk_bins.resize(tile_count);
+        for (auto & bin : chunk_bins) bin.clear();
+
+        size_t first = chunk * TRIANGLES_PER_SETUP_CHUNK;
+        size_t last = std::min(first + TRIANGLES_PER_SETUP_CHUNK, triangle_count);
+        CanvasTriangle clipped_triangles[MAX_CLIPPED_VERTICES - 2];
+        for (size_t i = first; i < last; i++) {
+            int clipped_count = setupTriangle(scene.mesh, g_transformed_vertices, i, frustum, clipped_triangles, frame.chunk_counters[chunk]);
+
+            for (int j = 0; j < clipped_count; j++) {
+                PixelRect bounds = getTriangleBounds(clipped_triangles[j], whole_canvas);
+                if (bounds.min_x > bounds.max_x) continue;
+
+                uint32_t setup_index = uint32_t(chunk_triangles.size());
+                chunk_triangles.push_back({clipped_triangles[j], uint32_t(i), 0});
+                for (int tile_y = bounds.min_y / SCREEN_TILE_SIZE; tile_y <= bounds.max_y / SCREEN_TILE_SIZE; tile_y++) {
+                    for (int tile_x = bounds.min_x / SCREEN_TILE_SIZE; tile_x <= bounds.max_x / SCREEN_TILE_SIZE; tile_x++) {
+                        chunk_bins[tile_y * tiles_across + tile_x].push_back(setup_index);
+                        chunk_triangles.back().tiles_touched++;
+                    }
+                }
+            }
+        }
+    });
+
+    g_thread_pool.parallelFor(tile_count, [&](size_t tile) {
+        int tile_x = int(tile % tiles_across) * SCREEN_TILE_SIZE;
+        int tile_y = int(tile / tiles_across) * SCREEN_TILE_SIZE;
+        PixelRect clip = {
+                tile_x,
+                tile_y,
+                std::min(tile_x + SCREEN_TILE_SIZE, int(target.width)) - 1,
+                std::min(tile_y + SCREEN_TILE_SIZE, int(target.height)) - 1
+        };
+
+        RasterCounters &counters = frame.tile_counters[tile];
+        std::vector<std::pair<uint32_t, uint32_t>> &culled = frame.occlusion_culled[tile];
+        culled.clear();
+
+//      walking the chunks in order keeps triangles in model order, so the result matches the serial path exactly
+        for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+            for (uint32_t setup_index : frame.bins[chunk][tile]) {
+                const SetupTriangle &setup_triangle = frame.setup_triangles[chunk][setup_index];
+                size_t culled_before = counters.triangles_occlusion_culled;
+                const Material &material = scene.materials[scene.mesh.materials[setup_triangle.model_index]];
+                drawTriangle(target, setup_triangle.canvas_triangle, material, target.depthBuffer, clip, counters);
+                if (counters.triangles_occlusion_culled != culled_before) culled.emplace_back(uint32_t(chunk), setup_index);
+            }
+        }
+    });
 
-            if (next_line.at(0) == 'u') {
-                current_colour = parsed_line[1];
+//  a triangle only counts as culled if every tile it was binned into rejected it
+    for (const auto & culled : frame.occlusion_culled) {
+        for (const auto & culled_triangle : culled) {
+            if (--frame.setup_triangles[culled_triangle.first][culled_triangle.second].tiles_touched == 0) g_frame_stats.triangles_occlusion_culled++;
+        }
+    }
+    for (const auto & counters : frame.chunk_counters) {
+        g_frame_stats.geometry.triangles_backface_culled += counters.triangles_backface_culled;
+        g_frame_stats.geometry.triangles_frustum_culled += counters.triangles_frustum_culled;
+        g_frame_stats.geometry.triangles_clipped += counters.triangles_clipped;
+        g_frame_stats.geometry.triangles_emitted += counters.triangles_emitted;
+    }
+    for (const auto & counters : frame.tile_counters) {
+        g_frame_stats.tile_triangles_occlusion_culled += counters.triangles_occlusion_culled;
+        g_frame_stats.blocks_occlusion_culled += counters.blocks_occlusion_culled;
+    }
+}
 
-            } else if (next_line.at(0) == 'v') {
-                float x = std::stof((parsed_line[1])) * scaling_factor;
-                float y = std::stof((parsed_line[2])) * scaling_factor;
-                float z = std::stof((parsed_line[3])) * scaling_factor;
+// direction (in world space, not normalised) of the ray from the camera through the point (x, y) on the canvas;
+// the inverse of projectCameraSpaceVertex, so the ray tracer sees exactly what the rasteriser would
+glm::vec3 getRayDirection(float x, float y, float canvas_width, float canvas_height) {
+    float scale = FOCAL_LENGTH * imagePlaneScale(canvas_height);
+    glm::vec3 camera_space((x - canvas_width / 2) / scale, -(y - canvas_height / 2) / scale, -1.0f);
+//  camera space is (v - camera) * orientation, and the orientation is orthonormal, so this undoes it
+    return g_camera_orientation * camera_space;
+}
 
-                glm::vec3 next_vertex(x, y, z);
-                vertex_tracker.push_back(next_vertex);
+// the mesh triangle as a ModelTriangle, coloured by its material, for anything that wants the whole triangle
+ModelTriangle getModelTriangle(const Scene& scene, size_t triangle_index) {
+    const uint32_t *indices = &scene.mesh.indices[triangle_index * 3];
+    const Material &material = scene.materials[scene.mesh.materials[triangle_index]];
+    Colour colour(scene.materials.name(scene.mesh.materials[triangle_index]), (material.argb >> 16) & 0xFF, (material.argb >> 8) & 0xFF, material.argb & 0xFF);
+    ModelTriangle triangle(scene.mesh.position(indices[0]), scene.mesh.position(indices[1]), scene.mesh.position(indices[2]), colour);
+    for (int i = 0; i < 3; i++) {
+        glm::vec2 texture_point = scene.mesh.textureCoordinate(indices[i]);
+        triangle.texturePoints[i] = TexturePoint(texture_point.x, texture_point.y);
+    }
+    triangle.texture = material.texture;
+    triangle.normal = glm::normalize(glm::cross(triangle.vertices[1] - triangle.vertices[0], triangle.vertices[2] - triangle.vertices[0]));
+    return triangle;
+}
 
-            } else if (next_line.at(0) == 'f') {
-                int v0_index = std::stoi(split(parsed_line[1], '/')[0]) - 1;
-                int v1_index = std::stoi(split(parsed_line[2], '/')[0]) - 1;
-                int v2_index = std::stoi(split(parsed_line[3], '/')[0]) - 1;
+RayTriangleIntersection makeIntersection(const Scene& scene, const glm::vec3& ray_origin, const glm::vec3& ray_direction, bool found, const BvhHit& hit) {
+    if (!found) {
+        RayTriangleIntersection miss;
+        miss.distanceFromCamera = std::numeric_limits<float>::infinity();
+        miss.triangleIndex = RayTriangleIntersection::NO_TRIANGLE;
+        return miss;
+    }
+    return RayTriangleIntersection(ray_origin + hit.distance * ray_direction, hit.distance, getModelTriangle(scene, hit.triangle), hit.triangle);
+}
 
-                ModelTriangle next_triangle(vertex_tracker[v0_index], vertex_tracker[v1_index],vertex_tracker[v2_index], parsed_palette[current_colour]);
+// nearest triangle along a normalised ray, or one whose triangleIndex is NO_TRIANGLE if it hits nothing
+RayTriangleIntersection getClosestValidIntersection(const Scene& scene, const glm::vec3& ray_origin, const glm::vec3& ray_direction) {
+    BvhHit hit;
+    bool found = scene.bvh.closestHit(ray_origin, ray_direction, std::numeric_limits<float>::infinity(), hit);
+    return makeIntersection(scene, ray_origin, ray_direction, found, hit);
+}
 
-                parsed_model_triangles.push_back(next_triangle);
+// any triangle closer than max_distance along a normalised ray, which is enough to know that something is in the way
+RayTriangleIntersection getAnyIntersection(const Scene& scene, const glm::vec3& ray_origin, const glm::vec3& ray_direction, float max_distance) {
+    BvhHit hit;
+    bool found = scene.bvh.anyHit(ray_origin, ray_direction, max_distance, hit);
+    return makeIntersection(scene, ray_origin, ray_direction, found, hit);
+}
 
-            }
+// colour of the surface a camera ray hit, unlit like the rasteriser's so the two can be compared pixel for pixel
+uint32_t shadeHit(const Scene& scene, const BvhHit& hit) {
+    const Material &material = scene.materials[scene.mesh.materials[hit.triangle]];
+    if (!material.hasFlag(MATERIAL_TEXTURED)) return material.argb;
+    const uint32_t *indices = &scene.mesh.indices[hit.triangle * 3];
+    glm::vec2 texture_point = (1 - hit.u - hit.v) * scene.mesh.textureCoordinate(indices[0]) +
+            hit.u * scene.mesh.textureCoordinate(indices[1]) + hit.v * scene.mesh.textureCoordinate(indices[2]);
+//  there are no screen space derivatives to pick a mip level with, so the full size level is sampled
+    TextureFilter filter = g_texture_filter == TextureFilter::Nearest ? TextureFilter::Nearest : TextureFilter::Bilinear;
+    return material.texture->sample(texture_point.x, texture_point.y, 0, filter);
+}
+
+// how far along a shadow ray from a surface it starts (and short of the light it stops), so that it doesn't hit the
+// triangle it starts on
+#define SHADOW_RAY_OFFSET 1e-3f
+// how bright a surface is, as a fraction of its colour, where none of the lights can see it
+#define SHADOW_AMBIENT 0.3f
+
+uint32_t scaleColour(uint32_t argb, float brightness) {
+    uint32_t red = uint32_t(float((argb >> 16) & 0xFF) * brightness);
+    uint32_t green = uint32_t(float((argb >> 8) & 0xFF) * brightness);
+    uint32_t blue = uint32_t(float(argb & 0xFF) * brightness);
+    return (argb & 0xFF000000) | (red << 16) | (green << 8) | blue;
+}
+
+// what the ray tracer counts for g_frame_stats, kept for each tile separately and added up once they're all done
+struct RayCounters {
+    size_t rays_traced = 0;
+    size_t rays_hit = 0;
+    size_t shadow_rays_traced = 0;
+    size_t shadow_rays_occluded = 0;
+};
+
+void addRayCounters(const std::vector<RayCounters>& tile_counters, FrameStats& stats) {
+    for (const RayCounters& counters : tile_counters) {
+        stats.rays_traced += counters.rays_traced;
+        stats.rays_hit += counters.rays_hit;
+        stats.shadow_rays_traced += counters.shadow_rays_traced;
+        stats.shadow_rays_occluded += counters.shadow_rays_occluded;
+    }
+}
+
+// Fraction of the full brightness that the lights the surface point can see leave it with. last_occluders holds
+// one WideBvh::occluded cache for each light.
+float lightVisibility(const Scene& scene, const glm::vec3& surface, std::vector<uint32_t>& last_occluders, RayCounters& counters) {
+    if (scene.lights.empty()) return 1.0f;
+    size_t lights_seen = 0;
+    for (size_t light = 0; light < scene.lights.size(); light++) {
+        glm::vec3 to_light = scene.lights[light] - surface;
+        float light_distance = glm::length(to_light);
+        counters.shadow_rays_traced++;
+        if (light_distance > 2 * SHADOW_RAY_OFFSET &&
+                scene.bvh.occluded(surface, to_light / light_distance, SHADOW_RAY_OFFSET, light_distance - SHADOW_RAY_OFFSET, &last_occluders[light])) {
+            counters.shadow_rays_occluded++;
+        } else {
+            lights_seen++;
         }
     }
-    return parsed_model_triangles;
+    return SHADOW_AMBIENT + (1.0f - SHADOW_AMBIENT) * float(lights_seen) / float(scene.lights.size());
 }
 
-CanvasPoint projectVertexOntoCanvasPoint(glm::vec3 camera_position, float focal_length, glm::vec3 vertex_position, glm::mat3 camera_orientation) {
-    glm::vec3 camera_to_vertex = vertex_position - camera_position;
-    glm::vec3 adjusted_vector = camera_to_vertex * camera_orientation;
+// The calling thread's WideBvh::occluded cache for each light. The pool hands each thread a band of neighbouring
+// tiles, so their shadow rays are mostly blocked by the same triangles, and a stale entry (even one from another
+// scene) only costs a wasted block test.
+std::vector<uint32_t>& threadLastOccluders(const Scene& scene) {
+    thread_local std::vector<uint32_t> last_occluders;
+    last_occluders.resize(scene.lights.size(), WideBvh::NO_OCCLUDER);
+    return last_occluders;
+}
 
-    float u = -focal_length * (adjusted_vector.x / adjusted_vector.z) * 160 + WIDTH / 2;
-    float v = focal_length * (adjusted_vector.y / adjusted_vector.z) * 160 + HEIGHT / 2;
-    float depth = -1 / adjusted_vector.z;
+// colour of whatever the camera ray through (x, y) on a width x height canvas hits first, or 0 (what clearPixels
+// leaves) if it hits nothing
+uint32_t tracePixel(const Scene& scene, float x, float y, size_t width, size_t height, RayCounters& counters) {
+    glm::vec3 direction = glm::normalize(getRayDirection(x, y, width, height));
+    counters.rays_traced++;
+    BvhHit hit;
+    if (!scene.bvh.closestHit(g_camera_position, direction, std::numeric_limits<float>::infinity(), hit)) return 0;
+    counters.rays_hit++;
+    uint32_t colour = shadeHit(scene, hit);
+    if (!g_shadows) return colour;
+    glm::vec3 surface = g_camera_position + hit.distance * direction;
+    return scaleColour(colour, lightVisibility(scene, surface, threadLastOccluders(scene), counters));
+}
 
-    CanvasPoint projected_vertex(u, v);
-    projected_vertex.depth = depth;
+// small enough that there are plenty of tiles to go round even on a small canvas, big enough that each one's rays
+// are coherent and cover the cost of handing it out
+#define RAY_TILE_SIZE 16
+
+// One ray through the centre of every pixel, a RAY_TILE_SIZE square tile at a time on the pool. Tiles are numbered
+// in rows, so each thread starts on a band of neighbouring tiles and only steals others' once it is done with its own.
+void drawSceneRayTraced(RenderTarget &target, const Scene& scene) {
+    size_t tiles_across = (target.width + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE;
+    size_t tiles_down = (target.height + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE;
+    std::vector<RayCounters> tile_counters(tiles_across * tiles_down);
+
+    g_thread_pool.parallelFor(tile_counters.size(), [&](size_t tile) {
+        size_t first_x = tile % tiles_across * RAY_TILE_SIZE;
+        size_t first_y = tile / tiles_across * RAY_TILE_SIZE;
+        size_t last_x = std::min<size_t>(first_x + RAY_TILE_SIZE, target.width);
+        size_t last_y = std::min<size_t>(first_y + RAY_TILE_SIZE, target.height);
+        for (size_t y = first_y; y < last_y; y++) {
+            uint32_t *row = target.row(y);
+            for (size_t x = first_x; x < last_x; x++) row[x] = tracePixel(scene, x + 0.5f, y + 0.5f, target.width, target.height, tile_counters[tile]);
+        }
+    });
 
-    return projected_vertex;
+    addRayCounters(tile_counters, g_frame_stats);
 }
 
-void drawScene(DrawingWindow &window, const std::vector<ModelTriangle>& parsed_triangles) {
-    window.clearPixels();
-    std::vector<std::vector<float>> depth_vector(HEIGHT, std::vector<float>(WIDTH, 0.0));
+// in pixels across (and down) for each ray of the first pass after the view changes; each pass after that halves it
+#define REFINEMENT_COARSEST_SCALE 8
+// full resolution samples averaged into each pixel before refinement stops
+#define REFINEMENT_MAX_SAMPLES 64
+
+// How far progressive refinement has got since the view last changed. Each pass traces one ray for every
+// scale x scale block of pixels, from REFINEMENT_COARSEST_SCALE down to 1, and the full resolution passes then carry
+// on as samples (each through a different point in every pixel) which are averaged together, antialiasing the image.
+struct Refinement {
+    int scale = REFINEMENT_COARSEST_SCALE;
+//  full resolution passes finished so far
+    int samples = 0;
+//  the current pass's tiles that haven't been traced yet, in order, or none if it hasn't started
+    std::vector<uint32_t> remaining_tiles;
+//  how long the coarsest pass took, which is how long each slice of the other passes gets
+    double coarsest_milliseconds = 0;
+//  the coarse passes' pixels, each block filled with its ray's colour
+    PixelBuffer preview;
+//  the sum of every full resolution sample of each pixel, as alpha, red, green and blue
+    std::vector<glm::vec4> accumulation;
+
+    void restart() {
+        scale = REFINEMENT_COARSEST_SCALE;
+        samples = 0;
+        remaining_tiles.clear();
+    }
+    bool finished() const { return samples == REFINEMENT_MAX_SAMPLES; }
+};
+
+bool g_progressive_refinement = true;
+Refinement g_refinement;
+
+// Where in its pixel sample n's ray goes through: the middle for the first, so that one sample is exactly what
+// drawSceneRayTraced draws, then spread evenly over the pixel by the R2 sequence.
+glm::vec2 sampleOffset(int sample) {
+    float x = 0.5f + float(sample) * 0.7548776662f;
+    float y = 0.5f + float(sample) * 0.5698402910f;
+    return glm::vec2(x - std::floor(x), y - std::floor(y));
+}
 
-    for (const auto & parsed_triangle : parsed_triangles) {
-        std::vector<CanvasPoint> canvas_points;
+glm::vec4 unpackColour(uint32_t argb) {
+    return glm::vec4(float(argb >> 24), float((argb >> 16) & 0xFF), float((argb >> 8) & 0xFF), float(argb & 0xFF));
+}
+
+uint32_t packColour(const glm::vec4& colour) {
+    glm::uvec4 channels(glm::clamp(colour + 0.5f, 0.0f, 255.0f));
+    return (channels[0] << 24) | (channels[1] << 16) | (channels[2] << 8) | channels[3];
+}
+
+// Draws what the last finished pass of the refinement showed: the coarse preview until a full resolution pass has
+// finished, then the average of every full resolution sample so far
+void drawRefinement(RenderTarget &target, const Refinement& refinement) {
+    if (refinement.samples == 0) {
+        for (size_t y = 0; y < target.height; y++) std::copy_n(&refinement.preview[y * target.width], target.width, target.row(y));
+        return;
+    }
+    float weight = 1.0f / float(refinement.samples);
+    for (size_t y = 0; y < target.height; y++) {
+        uint32_t *row = target.row(y);
+        for (size_t x = 0; x < target.width; x++) row[x] = packColour(refinement.accumulation[y * target.width + x] * weight);
+    }
+}
+
+// Traces the next slice of the current pass, and if that finishes it, draws it into the target (to be presented
+// straight away) and returns true. The coarsest pass is always traced in one go. Every other slice only starts tiles
+// until it has taken as long as that did, leaving the rest for the next slice, so that a key press never waits for
+// much more than one coarse frame before the new view starts rendering. Tile costs vary far too much (with how
+// much of the scene they see) to guess how many will fit beforehand.
+bool refineScene(RenderTarget &target, const Scene& scene, Refinement& refinement) {
+    if (refinement.finished()) return false;
+    size_t pixel_count = target.width * target.height;
+    if (refinement.preview.size() != pixel_count) {
+        refinement.preview.assign(pixel_count, 0);
+        refinement.accumulation.assign(pixel_count, glm::vec4(0));
+    }
+//  tiles are RAY_TILE_SIZE rays square at every scale
+    int scale = refinement.scale;
+    size_t rays_across = (target.width + scale - 1) / scale;
+    size_t rays_down = (target.height + scale - 1) / scale;
+    size_t tiles_across = (rays_across + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE;
+    size_t tile_count = tiles_across * ((rays_down + RAY_TILE_SIZE - 1) / RAY_TILE_SIZE);
+    std::vector<uint32_t> &remaining = refinement.remaining_tiles;
+    if (remaining.empty()) {
+        for (size_t tile = 0; tile < tile_count; tile++) remaining.push_back(uint32_t(tile));
+        g_frame_stats = FrameStats();
+        g_frame_stats.triangles_submitted = scene.mesh.triangleCount();
+    }
 
-        for (const auto & vertex : parsed_triangle.vertices) {
-            canvas_points.push_back(projectVertexOntoCanvasPoint(g_camera_position, 2, vertex, g_camera_orientation));
+//  the coarse passes' rays go through the middle of their blocks
+    glm::vec2 offset = scale == 1 ? sampleOffset(refinement.samples) : glm::vec2(0.5f * float(scale));
+    std::vector<RayCounters> tile_counters(remaining.size());
+    std::vector<uint8_t> traced(remaining.size(), 0);
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration<double, std::milli>(refinement.coarsest_milliseconds);
+    bool whole_pass = scale == REFINEMENT_COARSEST_SCALE;
+    g_thread_pool.parallelFor(remaining.size(), [&](size_t index) {
+//      the first tile is always traced, so every slice gets somewhere
+        if (!whole_pass && index != 0 && std::chrono::steady_clock::now() > deadline) return;
+        traced[index] = 1;
+        size_t tile = remaining[index];
+        size_t first_x = tile % tiles_across * RAY_TILE_SIZE * scale;
+        size_t first_y = tile / tiles_across * RAY_TILE_SIZE * scale;
+        size_t last_x = std::min<size_t>(first_x + RAY_TILE_SIZE * scale, target.width);
+        size_t last_y = std::min<size_t>(first_y + RAY_TILE_SIZE * scale, target.height);
+        for (size_t y = first_y; y < last_y; y += scale) {
+            for (size_t x = first_x; x < last_x; x += scale) {
+                uint32_t colour = tracePixel(scene, x + offset.x, y + offset.y, target.width, target.height, tile_counters[index]);
+                if (scale == 1) {
+                    refinement.accumulation[y * target.width + x] += unpackColour(colour);
+                    continue;
+                }
+                for (size_t block_y = y; block_y < std::min<size_t>(y + scale, target.height); block_y++) {
+                    std::fill_n(&refinement.preview[block_y * target.width + x], std::min<size_t>(scale, target.width - x), colour);
+                }
+            }
         }
+    });
+    if (whole_pass) refinement.coarsest_milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    addRayCounters(tile_counters, g_frame_stats);
 
-        CanvasTriangle canvas_triangle(canvas_points[0], canvas_points[1], canvas_points[2]);
-        drawFilledTriangle(window, canvas_triangle, parsed_triangle.colour, depth_vector);
+    size_t still_remaining = 0;
+    for (size_t index = 0; index < remaining.size(); index++) {
+        if (!traced[index]) remaining[still_remaining++] = remaining[index];
+    }
+    remaining.resize(still_remaining);
+    if (!remaining.empty()) return false;
+
+    if (scale != 1) {
+        refinement.scale = scale / 2;
+//      the first full resolution pass starts the average afresh
+        if (refinement.scale == 1) std::fill(refinement.accumulation.begin(), refinement.accumulation.end(), glm::vec4(0));
+    } else {
+        refinement.samples++;
     }
+    drawRefinement(target, refinement);
+    return true;
+}
+
+void drawScene(RenderTarget &target, const Scene& scene) {
+    target.clearPixels();
+    target.depthBuffer.clear();
+    g_frame_stats = FrameStats();
+    g_frame_stats.triangles_submitted = scene.mesh.triangleCount();
+
+    if (g_render_mode == RenderMode::RayTraced) {
+        drawSceneRayTraced(target, scene);
+        return;
+    }
+
+    g_frame_stats.vertices_transformed = scene.mesh.vertexCount();
+
+    ViewFrustum frustum = makeViewFrustum(target.width, target.height, FOCAL_LENGTH);
+    transformVertices(scene.mesh, frustum, g_transformed_vertices);
 
+    if (g_tiled_rendering) {
+        drawSceneTiled(target, scene, frustum);
+        return;
+    }
+
+    PixelRect whole_canvas = {0, 0, int(target.width) - 1, int(target.height) - 1};
+    RasterCounters counters;
+    CanvasTriangle clipped_triangles[MAX_CLIPPED_VERTICES - 2];
+    for (size_t triangle = 0; triangle < scene.mesh.triangleCount(); triangle++) {
+        int clipped_count = setupTriangle(scene.mesh, g_transformed_vertices, triangle, frustum, clipped_triangles, g_frame_stats.geometry);
+        const Material &material = scene.materials[scene.mesh.materials[triangle]];
+        for (int i = 0; i < clipped_count; i++) {
+            drawTriangle(target, clipped_triangles[i], material, target.depthBuffer, whole_canvas, counters);
+        }
+    }
+    g_frame_stats.triangles_occlusion_culled = counters.triangles_occlusion_culled;
+    g_frame_stats.blocks_occlusion_culled = counters.blocks_occlusion_culled;
+}
+
+// refinement is only given when one is under way, which batch renders never have
+void printFrameStats(const FrameStats& stats, const Refinement *refinement = nullptr) {
+    std::cout << "triangles submitted: " << stats.triangles_submitted << std::endl;
+    if (g_render_mode == RenderMode::RayTraced) {
+        std::cout << "rays traced: " << stats.rays_traced << std::endl;
+        std::cout << "rays that hit a triangle: " << stats.rays_hit << std::endl;
+        if (refinement) {
+            if (refinement->scale != 1) std::cout << "refining: pass at 1/" << refinement->scale << " resolution" << std::endl;
+            else std::cout << "refining: " << refinement->samples << " of " << REFINEMENT_MAX_SAMPLES << " samples per pixel" << std::endl;
+        }
+        if (g_shadows) std::cout << "shadow rays traced: " << stats.shadow_rays_traced << " (" << stats.shadow_rays_occluded << " occluded)" << std::endl;
+        return;
+    }
+    std::cout << "vertices transformed: " << stats.vertices_transformed << std::endl;
+    std::cout << "triangles back-face culled: " << stats.geometry.triangles_backface_culled << std::endl;
+    std::cout << "triangles frustum culled: " << stats.geometry.triangles_frustum_culled << std::endl;
+    std::cout << "triangles clipped: " << stats.geometry.triangles_clipped << std::endl;
+    std::cout << "triangles after clipping: " << stats.geometry.triangles_emitted << std::endl;
+    std::cout << "triangles occlusion culled: " << stats.triangles_occlusion_culled << std::endl;
+    if (g_tiled_rendering) std::cout << "tile triangles occlusion culled: " << stats.tile_triangles_occlusion_culled << std::endl;
+    std::cout << "8x8 blocks occlusion culled: " << stats.blocks_occlusion_culled << std::endl;
 }
 
 
-void handleEvent(SDL_Event event, DrawingWindow &window) {
+// Draws the frame that the window loop last showed again, for Streaming mode, where it's gone once it has been
+// shown. A refinement is drawn from what it has traced so far rather than started again; by the time any event is
+// handled it has always finished at least its coarsest pass.
+void redrawShownFrame(RenderTarget &target, const Scene& scene) {
+    if (g_render_mode == RenderMode::RayTraced && g_progressive_refinement) drawRefinement(target, g_refinement);
+    else drawScene(target, scene);
+}
+
+// how long the window took to present the last frame it was given, for `p`
+double g_present_milliseconds = 0;
+
+void presentFrame(DrawingWindow &window) {
+    auto start = std::chrono::steady_clock::now();
+    window.renderFrame();
+    g_present_milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void handleEvent(SDL_Event event, DrawingWindow &window, const Scene& scene) {
     if (event.type == SDL_KEYDOWN) {
         switch (event.key.keysym.sym) {
             case SDLK_LEFT:
@@ -496,29 +1668,623 @@ void handleEvent(SDL_Event event, DrawingWindow &window) {
                 break;
             }
 
-            default:
+            case SDLK_1:
+                g_render_mode = RenderMode::Rasterised;
+                std::cout << "RENDER MODE: RASTERISED" << std::endl;
+                break;
+
+            case SDLK_2:
+                g_render_mode = RenderMode::RayTraced;
+                std::cout << "RENDER MODE: RAY TRACED" << std::endl;
                 break;
+
+            case SDLK_m:
+                g_tiled_rendering = !g_tiled_rendering;
+                std::cout << (g_tiled_rendering ? "TILED RENDERING ON" : "TILED RENDERING OFF") << std::endl;
+                break;
+
+            case SDLK_b:
+                g_backface_culling = !g_backface_culling;
+                std::cout << (g_backface_culling ? "BACK-FACE CULLING ON" : "BACK-FACE CULLING OFF") << std::endl;
+                break;
+
+            case SDLK_h:
+                g_occlusion_culling = !g_occlusion_culling;
+                std::cout << (g_occlusion_culling ? "OCCLUSION CULLING ON" : "OCCLUSION CULLING OFF") << std::endl;
+                break;
+
+            case SDLK_f:
+                if (g_texture_filter == TextureFilter::Nearest) {
+                    g_texture_filter = TextureFilter::Bilinear;
+                    std::cout << "TEXTURE FILTER: BILINEAR" << std::endl;
+                } else if (g_texture_filter == TextureFilter::Bilinear) {
+                    g_texture_filter = TextureFilter::Trilinear;
+                    std::cout << "TEXTURE FILTER: TRILINEAR" << std::endl;
+                } else {
+                    g_texture_filter = TextureFilter::Nearest;
+                    std::cout << "TEXTURE FILTER: NEAREST" << std::endl;
+                }
+                break;
+
+            case SDLK_s:
+                g_shadows = !g_shadows;
+                std::cout << (g_shadows ? "SHADOWS ON" : "SHADOWS OFF") << std::endl;
+                break;
+
+            case SDLK_g:
+                g_progressive_refinement = !g_progressive_refinement;
+                std::cout << (g_progressive_refinement ? "PROGRESSIVE REFINEMENT ON" : "PROGRESSIVE REFINEMENT OFF") << std::endl;
+                break;
+
+            case SDLK_p:
+//              the window loop refines whenever ray tracing with refinement on
+                printFrameStats(g_frame_stats, g_progressive_refinement ? &g_refinement : nullptr);
+                std::cout << "last present: " << g_present_milliseconds << " ms" << std::endl;
+                return;
+
+            case SDLK_r:
+                if (g_rasteriser_backend == RasteriserBackend::Scanline) {
+                    g_rasteriser_backend = RasteriserBackend::EdgeFunction;
+                    std::cout << "RASTERISER: EDGE FUNCTION" << std::endl;
+                } else {
+                    g_rasteriser_backend = RasteriserBackend::Scanline;
+                    std::cout << "RASTERISER: SCANLINE" << std::endl;
+                }
+                break;
+
+            default:
+                return;
+        }
+        g_view_version++;
+    } else if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+//      the frame hasn't changed, it just has to be shown again, which only Streaming mode can't do without drawing it
+        if (!window.presentAgain()) {
+            redrawShownFrame(window, scene);
+            presentFrame(window);
         }
     } else if (event.type == SDL_MOUSEBUTTONDOWN) {
-        window.savePPM("output.ppm");
-        window.saveBMP("output.bmp");
+//  only the copy happens here, the files are written on the writer's own thread while rendering carries on. The
+//  loop hasn't drawn anything since it last presented, so in Copy mode the frame on screen is still in the buffer;
+//  in Streaming mode it's drawn into the texture again (without being shown, as it's on screen already).
+        std::shared_ptr<const Image> frame = window.snapshotLastFrame();
+        if (!frame) {
+            redrawShownFrame(window, scene);
+            frame = window.snapshot();
+        }
+        g_image_writer.enqueue(frame, "output.ppm");
+        g_image_writer.enqueue(frame, "output.bmp");
     }
 }
 
+// orientation for a camera at `position` looking towards `target`, keeping world up (+y) pointing up on screen
+glm::mat3 lookAt(const glm::vec3& position, const glm::vec3& target) {
+//  the camera looks down its own -z, so its z axis points from the target back to the camera
+    glm::vec3 forward = glm::normalize(position - target);
+    glm::vec3 world_up = std::abs(forward.y) > 0.999f ? glm::vec3(0, 0, -1) : glm::vec3(0, 1, 0);
+    glm::vec3 right = glm::normalize(glm::cross(world_up, forward));
+    glm::vec3 up = glm::cross(forward, right);
+    return glm::mat3(right, up, forward);
+}
+
+// everything a headless render needs, filled in from the command line
+struct BatchOptions {
+    std::string model_file = "cornell-box.obj";
+    float scale = 0.35;
+    size_t width = WIDTH;
+    size_t height = HEIGHT;
+    glm::vec3 camera_position = glm::vec3(0.0, 0.0, 4.0);
+    bool has_look_at = false;
+    glm::vec3 look_at = glm::vec3(0.0);
+    int frames = 1;
+    std::string output_file = "output.ppm";
+    bool print_stats = false;
+    bool ray_trace = false;
+    bool shadows = false;
+//  the same defaults as the window starts with
+    RasteriserBackend rasteriser_backend = RasteriserBackend::Scanline;
+    bool tiled_rendering = true;
+    bool occlusion_culling = true;
+    bool backface_culling = true;
+    TextureFilter texture_filter = TextureFilter::Trilinear;
+    size_t bvh_leaf_size = BvhBuildOptions().maxLeafTriangles;
+    bool bvh_benchmark = false;
+    bool traversal_benchmark = false;
+    bool tiling_benchmark = false;
+};
+
+void printBatchUsage() {
+    std::cerr << "usage: RedNoise [--streaming] [--size 320x240] [model.obj]" << std::endl;
+    std::cerr << "       RedNoise --batch [--model model.obj] [--scale 0.35] [--size 320x240] [--camera x,y,z]" << std::endl;
+    std::cerr << "                        [--look-at x,y,z] [--frames 1] [--output output.ppm|.bmp|.pfm] [--stats]" << std::endl;
+    std::cerr << "                        [--ray-trace] [--shadows] [--rasteriser scanline|edge] [--no-tiles]" << std::endl;
+    std::cerr << "                        [--no-occlusion-culling] [--no-backface-culling]" << std::endl;
+    std::cerr << "                        [--filter nearest|bilinear|trilinear] [--leaf-size 8] [--bvh-benchmark]" << std::endl;
+    std::cerr << "                        [--traversal-benchmark] [--tiling-benchmark]" << std::endl;
+}
+
+glm::vec3 parseVector(const std::string& text) {
+    std::vector<std::string> components = split(text, ',');
+    if (components.size() != 3) throw std::invalid_argument("expected x,y,z but got \"" + text + "\"");
+    return glm::vec3(std::stof(components[0]), std::stof(components[1]), std::stof(components[2]));
+}
+
+void parseSize(const std::string& text, size_t& width, size_t& height) {
+    std::vector<std::string> dimensions = split(text, 'x');
+    if (dimensions.size() != 2) throw std::invalid_argument("expected WIDTHxHEIGHT but got \"" + text + "\"");
+    int parsed_width = std::stoi(dimensions[0]);
+    int parsed_height = std::stoi(dimensions[1]);
+    if (parsed_width <= 0 || parsed_height <= 0) throw std::invalid_argument("the size must be positive");
+    width = parsed_width;
+    height = parsed_height;
+}
+
+// throws std::invalid_argument (or whatever std::stoi and std::stof throw) on anything it doesn't understand
+BatchOptions parseBatchOptions(int argc, char *argv[]) {
+    BatchOptions options;
+    for (int i = 2; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--stats") {
+            options.print_stats = true;
+            continue;
+        }
+        if (option == "--ray-trace") {
+            options.ray_trace = true;
+            continue;
+        }
+        if (option == "--shadows") {
+            options.shadows = true;
+            continue;
+        }
+        if (option == "--no-tiles") {
+            options.tiled_rendering = false;
+            continue;
+        }
+        if (option == "--no-occlusion-culling") {
+            options.occlusion_culling = false;
+            continue;
+        }
+        if (option == "--no-backface-culling") {
+            options.backface_culling = false;
+            continue;
+        }
+        if (option == "--bvh-benchmark") {
+            options.bvh_benchmark = true;
+            continue;
+        }
+        if (option == "--traversal-benchmark") {
+            options.traversal_benchmark = true;
+            continue;
+        }
+        if (option == "--tiling-benchmark") {
+            options.tiling_benchmark = true;
+            continue;
+        }
+        if (i + 1 >= argc) throw std::invalid_argument(option + " needs a value");
+        std::string value = argv[++i];
+
+        if (option == "--model") {
+            options.model_file = value;
+        } else if (option == "--scale") {
+            options.scale = std::stof(value);
+        } else if (option == "--size") {
+            parseSize(value, options.width, options.height);
+        } else if (option == "--camera") {
+            options.camera_position = parseVector(value);
+        } else if (option == "--look-at") {
+            options.look_at = parseVector(value);
+            options.has_look_at = true;
+        } else if (option == "--frames") {
+            options.frames = std::stoi(value);
+            if (options.frames <= 0) throw std::invalid_argument("--frames must be at least 1");
+        } else if (option == "--output") {
+            options.output_file = value;
+        } else if (option == "--rasteriser") {
+            if (value == "scanline") options.rasteriser_backend = RasteriserBackend::Scanline;
+            else if (value == "edge") options.rasteriser_backend = RasteriserBackend::EdgeFunction;
+            else throw std::invalid_argument("expected scanline or edge but got \"" + value + "\"");
+        } else if (option == "--filter") {
+            if (value == "nearest") options.texture_filter = TextureFilter::Nearest;
+            else if (value == "bilinear") options.texture_filter = TextureFilter::Bilinear;
+            else if (value == "trilinear") options.texture_filter = TextureFilter::Trilinear;
+            else throw std::invalid_argument("expected nearest, bilinear or trilinear but got \"" + value + "\"");
+        } else if (option == "--leaf-size") {
+            int leaf_size = std::stoi(value);
+            if (leaf_size <= 0 || size_t(leaf_size) > WideBvh::MAX_LEAF_TRIANGLES) {
+                throw std::invalid_argument("--leaf-size must be from 1 to " + std::to_string(WideBvh::MAX_LEAF_TRIANGLES));
+            }
+            options.bvh_leaf_size = leaf_size;
+        } else {
+            throw std::invalid_argument("unknown option " + option);
+        }
+    }
+    return options;
+}
+
+// what the window can be started with; anything else on the command line goes with --batch
+struct WindowOptions {
+    std::string model_file = "cornell-box.obj";
+    size_t width = WIDTH;
+    size_t height = HEIGHT;
+    PresentMode present_mode = PresentMode::Copy;
+};
+
+// throws std::invalid_argument (or whatever std::stoi throws) on anything it doesn't understand, which includes a
+// mistyped --batch
+WindowOptions parseWindowOptions(int argc, char *argv[]) {
+    WindowOptions options;
+    bool has_model = false;
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--streaming") {
+            options.present_mode = PresentMode::Streaming;
+        } else if (option == "--size") {
+            if (i + 1 >= argc) throw std::invalid_argument(option + " needs a value");
+            parseSize(argv[++i], options.width, options.height);
+        } else if (option.rfind("--", 0) == 0) {
+            throw std::invalid_argument("unknown option " + option);
+        } else if (has_model) {
+            throw std::invalid_argument("too many arguments");
+        } else {
+            options.model_file = option;
+            has_model = true;
+        }
+    }
+    return options;
+}
+
+// builds the scene's BVH `runs` times each on one thread and on the whole pool, and checks that both builders made
+// the same tree (the layout of the nodes in memory is all that is allowed to differ), returning whether they did
+bool runBvhBenchmark(const Scene& scene, size_t leaf_size, int runs) {
+    BvhBuildOptions serial_options;
+    serial_options.maxLeafTriangles = leaf_size;
+    serial_options.trianglesPerTest = TriangleBlock::SIZE;
+    BvhBuildOptions parallel_options = serial_options;
+    parallel_options.pool = &g_thread_pool;
+
+    double serial_best = std::numeric_limits<double>::infinity();
+    double parallel_best = std::numeric_limits<double>::infinity();
+    BvhBuildStats serial_stats, parallel_stats;
+    for (int run = 0; run < runs; run++) {
+        serial_stats = Bvh(scene.mesh, serial_options).stats();
+        serial_best = std::min(serial_best, serial_stats.milliseconds);
+        parallel_stats = Bvh(scene.mesh, parallel_options).stats();
+        parallel_best = std::min(parallel_best, parallel_stats.milliseconds);
+    }
+    std::cout << "BVH over " << scene.mesh.triangleCount() << " triangles, leaves of at most " << leaf_size << ", best of " << runs << ":" << std::endl;
+    std::cout << "serial:   " << serial_best << " ms" << std::endl;
+    std::cout << "parallel: " << parallel_best << " ms on " << g_thread_pool.size() << " threads (" << serial_best / parallel_best << "x)" << std::endl;
+    bool same = serial_stats.nodeCount == parallel_stats.nodeCount && serial_stats.leafCount == parallel_stats.leafCount &&
+            serial_stats.maxDepth == parallel_stats.maxDepth && serial_stats.sahCost == parallel_stats.sahCost;
+    std::cout << (same ? "both builders made the same tree" : "THE BUILDERS MADE DIFFERENT TREES") << std::endl;
+    printBvhStats(parallel_stats);
+    return same;
+}
+
+// roughly how many ray-triangle tests runTraversalBenchmark spends on checking each kind of ray, which for a small
+// scene is enough to check every ray
+#define TRAVERSAL_CHECK_TRIANGLE_TESTS 50000000
+
+// The nearest hit that testing every one of the BVH's triangles finds, in the same way as the BVH tests them
+bool searchEveryTriangle(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, float max_distance, BvhHit& nearest) {
+    bool found = false;
+    for (const BvhTriangle& triangle : bvh.getTriangles()) {
+        if (intersectTriangle(triangle, origin, direction, max_distance, nearest)) {
+            max_distance = nearest.distance;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool searchEveryTriangle(const WideBvh& bvh, const glm::vec3& origin, const glm::vec3& direction, float max_distance, BvhHit& nearest) {
+    bool found = false;
+    for (const TriangleBlock& block : bvh.getBlocks()) {
+        if (intersectTriangleBlock(block, origin, direction, max_distance, nearest)) {
+            max_distance = nearest.distance;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Whether a BVH query gave the answer that searchEveryTriangle expected. With the same arithmetic the distance has
+// to be exactly the same; a different triangle at exactly the same distance is a ray through an edge or corner
+// that triangles share, where either one is right.
+bool sameAnswer(bool any_hit, bool found, const BvhHit& hit, bool expected_found, const BvhHit& expected) {
+    if (found != expected_found) return false;
+    if (!found || any_hit) return true;
+    return hit.distance == expected.distance;
+}
+
+// rays for runTraversalBenchmark, all of one kind
+struct BenchmarkRays {
+    const char *kind;
+//  shadow rays only need to know if anything is in the way, the others want the nearest hit
+    bool any_hit;
+    std::vector<glm::vec3> origins;
+    std::vector<glm::vec3> directions;
+    std::vector<float> max_distances;
+
+    void add(const glm::vec3& origin, const glm::vec3& direction, float max_distance) {
+        origins.push_back(origin);
+        directions.push_back(direction);
+        max_distances.push_back(max_distance);
+    }
+};
+
+// Traces three kinds of ray, each through the binary BVH (built for one triangle per test) and the scene's wide one,
+// best of `runs` on one thread, and checks that they agree:
+//   primary: one from the current camera through every pixel of a width x height canvas
+//   shadow: from every surface a primary ray hit, to the scene's first light
+//   random: as many as there are pixels, from anywhere in the scene's bounds in any direction, so incoherent
+// then times the shadow rays through the wide BVH's other ways of answering them. Returns false if either BVH found
+// a different hit (or none) from testing every triangle, or the shadow queries didn't all give the same answers.
+bool runTraversalBenchmark(const Scene& scene, size_t leaf_size, size_t width, size_t height, int runs) {
+    BvhBuildOptions bvh_options;
+    bvh_options.maxLeafTriangles = leaf_size;
+    bvh_options.pool = &g_thread_pool;
+    Bvh binary_bvh(scene.mesh, bvh_options);
+    float no_limit = std::numeric_limits<float>::infinity();
+
+    Aabb scene_bounds = meshBounds(scene.mesh);
+    glm::vec3 scene_size = scene_bounds.max - scene_bounds.min;
+
+    BenchmarkRays primary{"primary", false, {}, {}, {}};
+    BenchmarkRays shadow{"shadow", true, {}, {}, {}};
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            glm::vec3 direction = glm::normalize(getRayDirection(x + 0.5f, y + 0.5f, width, height));
+            primary.add(g_camera_position, direction, no_limit);
+            BvhHit hit;
+            if (scene.lights.empty() || !scene.bvh.closestHit(g_camera_position, direction, no_limit, hit)) continue;
+            glm::vec3 surface = g_camera_position + hit.distance * direction;
+            float light_distance = glm::length(scene.lights.front() - surface);
+            if (!(light_distance > 2 * SHADOW_RAY_OFFSET)) continue;
+            glm::vec3 to_light = (scene.lights.front() - surface) / light_distance;
+            shadow.add(surface + to_light * SHADOW_RAY_OFFSET, to_light, light_distance - 2 * SHADOW_RAY_OFFSET);
+        }
+    }
+    BenchmarkRays random{"random", false, {}, {}, {}};
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> anywhere(0.0f, 1.0f);
+    std::normal_distribution<float> any_direction;
+    for (size_t i = 0; i < width * height; i++) {
+        glm::vec3 origin = scene_bounds.min + glm::vec3(anywhere(generator), anywhere(generator), anywhere(generator)) * scene_size;
+        glm::vec3 direction(any_direction(generator), any_direction(generator), any_direction(generator));
+        random.add(origin, glm::normalize(direction), no_limit);
+    }
+
+    bool all_right = true;
+    std::cout << "BVH traversal on one thread, best of " << runs << ", binary BVH then " << WideBvh::MAX_CHILDREN
+              << "-wide BVH testing " << TriangleBlock::SIZE << " triangles at a time:" << std::endl;
+    for (const BenchmarkRays *rays : {&primary, &shadow, &random}) {
+        size_t count = rays->directions.size();
+        std::vector<BvhHit> binary_hits(count), wide_hits(count);
+        std::vector<bool> binary_found(count), wide_found(count);
+        auto time_rays = [&](const auto& bvh, std::vector<BvhHit>& hits, std::vector<bool>& found) {
+            double best = std::numeric_limits<double>::infinity();
+            for (int run = 0; run < runs; run++) {
+                auto start = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < count; i++) {
+                    found[i] = rays->any_hit ? bvh.anyHit(rays->origins[i], rays->directions[i], rays->max_distances[i], hits[i]) :
+                            bvh.closestHit(rays->origins[i], rays->directions[i], rays->max_distances[i], hits[i]);
+                }
+                best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            }
+            return best;
+        };
+        double binary_best = time_rays(binary_bvh, binary_hits, binary_found);
+        double wide_best = time_rays(scene.bvh, wide_hits, wide_found);
+
+        size_t hits = 0, checked = 0, edge_differences = 0, wrong = 0;
+        size_t stride = std::max<size_t>(1, count * scene.mesh.triangleCount() / TRAVERSAL_CHECK_TRIANGLE_TESTS);
+        for (size_t i = 0; i < count; i++) {
+            hits += binary_found[i];
+//          the block test does the same arithmetic as intersectTriangle, but the compiler is free to fuse the scalar
+//          version's multiplies and adds, so distances only have to agree to within rounding
+            bool same_hit = rays->any_hit || !binary_found[i] || (binary_hits[i].triangle == wide_hits[i].triangle &&
+                    std::abs(binary_hits[i].distance - wide_hits[i].distance) <= 1e-5f * std::max(1.0f, binary_hits[i].distance));
+            bool agree = binary_found[i] == wide_found[i] && same_hit;
+//          Every disagreement is looked into, and a sample of the rest. Rounding can put a ray that grazes an edge
+//          on a triangle for one test and off it for the other, and then both BVHs are right as long as each finds
+//          what its own test finds among all the triangles.
+            if (agree && i % stride != 0) continue;
+            checked++;
+            BvhHit expected {};
+            bool binary_right = sameAnswer(rays->any_hit, binary_found[i], binary_hits[i],
+                                           searchEveryTriangle(binary_bvh, rays->origins[i], rays->directions[i], rays->max_distances[i], expected), expected);
+            bool wide_right = sameAnswer(rays->any_hit, wide_found[i], wide_hits[i],
+                                         searchEveryTriangle(scene.bvh, rays->origins[i], rays->directions[i], rays->max_distances[i], expected), expected);
+            if (!binary_right || !wide_right) wrong++;
+            else if (!agree) edge_differences++;
+        }
+        std::cout << rays->kind << ": " << count << " rays, " << hits << " hit: " << count / binary_best / 1000 << " then "
+                  << count / wide_best / 1000 << " Mrays/s (" << binary_best / wide_best << "x), " << checked
+                  << " checked against every triangle";
+        if (edge_differences != 0) std::cout << ", " << edge_differences << " through triangle edges, where the two tests can round differently";
+        if (wrong != 0) std::cout << ", " << wrong << " RAYS FOUND THE WRONG HIT";
+        std::cout << std::endl;
+        all_right = all_right && wrong == 0;
+    }
+
+    size_t count = shadow.directions.size();
+    if (count == 0) return all_right;
+    auto time_shadow_rays = [&](std::vector<bool>& blocked, const auto& query) {
+        double best = std::numeric_limits<double>::infinity();
+        for (int run = 0; run < runs; run++) {
+            auto start = std::chrono::steady_clock::now();
+            uint32_t last_occluder = WideBvh::NO_OCCLUDER;
+            for (size_t i = 0; i < count; i++) blocked[i] = query(shadow.origins[i], shadow.directions[i], shadow.max_distances[i], last_occluder);
+            best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    };
+    std::vector<bool> by_closest(count), by_any(count), by_occluded(count), by_cached(count);
+//  what a shadow test written with getClosestValidIntersection does: find the nearest hit, then see if it's closer than the light
+    double closest_best = time_shadow_rays(by_closest, [&](const glm::vec3& origin, const glm::vec3& direction, float max_distance, uint32_t&) {
+        BvhHit hit;
+        return scene.bvh.closestHit(origin, direction, no_limit, hit) && hit.distance < max_distance;
+    });
+    double any_best = time_shadow_rays(by_any, [&](const glm::vec3& origin, const glm::vec3& direction, float max_distance, uint32_t&) {
+        BvhHit hit;
+        return scene.bvh.anyHit(origin, direction, max_distance, hit);
+    });
+    double occluded_best = time_shadow_rays(by_occluded, [&](const glm::vec3& origin, const glm::vec3& direction, float max_distance, uint32_t&) {
+        return scene.bvh.occluded(origin, direction, 0.0f, max_distance);
+    });
+    double cached_best = time_shadow_rays(by_cached, [&](const glm::vec3& origin, const glm::vec3& direction, float max_distance, uint32_t& last_occluder) {
+        return scene.bvh.occluded(origin, direction, 0.0f, max_distance, &last_occluder);
+    });
+    size_t disagreements = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (by_any[i] != by_closest[i] || by_occluded[i] != by_closest[i] || by_cached[i] != by_closest[i]) disagreements++;
+    }
+    std::cout << "shadow rays through the " << WideBvh::MAX_CHILDREN << "-wide BVH, nearest hit: " << count / closest_best / 1000
+              << ", any hit: " << count / any_best / 1000 << ", occluded: " << count / occluded_best / 1000
+              << ", occluded with a last occluder cache: " << count / cached_best / 1000 << " Mrays/s ("
+              << closest_best / cached_best << "x nearest hit)";
+    if (disagreements != 0) std::cout << ", " << disagreements << " RAYS DISAGREED";
+    std::cout << std::endl;
+    return all_right && disagreements == 0;
+}
+
+// how much slower than drawing the whole frame at once the tiled path may be before --tiling-benchmark fails; on one
+// thread tiling can only add the cost of binning, so anything near this means a tile is paying for pixels it doesn't own
+#define TILING_SLOWDOWN_LIMIT 2.0
+
+// draws the frame `frames` times tiled and `frames` times untiled, keeping the fastest of each, and checks that both
+// paths drew the same pixels and that tiling is no more than TILING_SLOWDOWN_LIMIT times slower, returning whether so
+bool runTilingBenchmark(OffscreenTarget& target, const Scene& scene, int frames) {
+    auto time_frames = [&](bool tiled) {
+        g_tiled_rendering = tiled;
+        double best = std::numeric_limits<double>::infinity();
+        for (int frame = 0; frame < frames; frame++) {
+            auto start = std::chrono::steady_clock::now();
+            drawScene(target, scene);
+            best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    };
+    double untiled_best = time_frames(false);
+    std::vector<uint32_t> untiled_pixels;
+    for (size_t y = 0; y < target.height; y++) untiled_pixels.insert(untiled_pixels.end(), target.row(y), target.row(y) + target.width);
+    double tiled_best = time_frames(true);
+    size_t differences = 0;
+    for (size_t y = 0; y < target.height; y++) {
+        for (size_t x = 0; x < target.width; x++) if (target.row(y)[x] != untiled_pixels[y * target.width + x]) differences++;
+    }
+
+    bool fast_enough = tiled_best <= untiled_best * TILING_SLOWDOWN_LIMIT;
+    std::cout << target.width << "x" << target.height << " on " << g_thread_pool.size() << " thread(s), untiled: "
+              << untiled_best << " ms, tiled: " << tiled_best << " ms (" << untiled_best / tiled_best << "x untiled)";
+    if (differences != 0) std::cout << ", " << differences << " PIXELS DIFFER";
+    if (!fast_enough) std::cout << ", TILING IS MORE THAN " << TILING_SLOWDOWN_LIMIT << "x SLOWER";
+    std::cout << std::endl;
+    return differences == 0 && fast_enough;
+}
+
+// renders without a window: the frame is drawn `frames` times as fast as the pool allows (which is what makes the
+// timing meaningful), then the last one is written out and the process exits
+int runBatch(int argc, char *argv[]) {
+    BatchOptions options;
+    try {
+        options = parseBatchOptions(argc, argv);
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        printBatchUsage();
+        return 1;
+    }
+
+    try {
+        OffscreenTarget target(options.width, options.height);
+        Scene scene = loadScene(options.model_file, options.scale, options.bvh_leaf_size);
+        if (options.bvh_benchmark) return runBvhBenchmark(scene, options.bvh_leaf_size, 5) ? 0 : 1;
+        g_camera_position = options.camera_position;
+        if (options.has_look_at) g_camera_orientation = lookAt(options.camera_position, options.look_at);
+        if (options.ray_trace) g_render_mode = RenderMode::RayTraced;
+        g_shadows = options.shadows;
+        g_rasteriser_backend = options.rasteriser_backend;
+        g_tiled_rendering = options.tiled_rendering;
+        g_occlusion_culling = options.occlusion_culling;
+        g_backface_culling = options.backface_culling;
+        g_texture_filter = options.texture_filter;
+        if (options.traversal_benchmark) return runTraversalBenchmark(scene, options.bvh_leaf_size, options.width, options.height, 5) ? 0 : 1;
+        if (options.tiling_benchmark) return runTilingBenchmark(target, scene, options.frames) ? 0 : 1;
+
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < options.frames; frame++) drawScene(target, scene);
+        double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        target.save(options.output_file);
+        std::cout << "rendered " << options.frames << " frame(s) of " << options.width << "x" << options.height
+                  << " in " << milliseconds << " ms (" << milliseconds / options.frames << " ms per frame) to "
+                  << options.output_file << std::endl;
+        if (options.print_stats) printFrameStats(g_frame_stats);
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// the longest the window loop sleeps for when there is nothing to draw
+#define IDLE_WAIT_MILLISECONDS 250
+
 int main(int argc, char *argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--batch") return runBatch(argc, argv);
 
-    DrawingWindow window = DrawingWindow(WIDTH, HEIGHT, false);
+//  the model can be given on the command line, e.g. textured-cornell-box.obj, and defaults to the plain cornell box
+    if (argc == 2 && std::string(argv[1]) == "--help") {
+        printBatchUsage();
+        return 0;
+    }
+    WindowOptions options;
+    try {
+        options = parseWindowOptions(argc, argv);
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        printBatchUsage();
+        return 1;
+    }
+//  loaded before the window opens, so that a missing or broken model doesn't flash up an empty window
+    Scene scene;
+    try {
+        scene = loadScene(options.model_file, 0.35);
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
 
-    SDL_Event event;
+//  The window is only redrawn when something has changed, so a single buffer copied to the screen is plenty at the
+//  usual size. --streaming draws straight into the texture instead, which saves the copy on every present at 4K.
+    DrawingWindow window(options.width, options.height, false, options.present_mode);
 
-    std::vector<ModelTriangle> parsed_triangles = parseModelObjFile("cornell-box.obj", 0.35);
+    SDL_Event event;
 
+//  the g_view_version that the frame in the window (or the refinement under way) is of
+    uint64_t drawn_version = 0;
+    auto refining = [] { return g_render_mode == RenderMode::RayTraced && g_progressive_refinement; };
+    auto nothingToDraw = [&] { return drawn_version == g_view_version && (!refining() || g_refinement.finished()); };
     while (true) {
-        if (window.pollForInputEvents(event)) handleEvent(event, window);
-
-        drawScene(window, parsed_triangles);
+//      With nothing new to draw, the loop sleeps until something happens rather than spinning, so an idle window
+//      costs next to no CPU. It still wakes every IDLE_WAIT_MILLISECONDS, so that a wake-up SDL misses can't leave
+//      it asleep for good.
+        bool has_event = nothingToDraw() ? window.waitForInputEvents(event, IDLE_WAIT_MILLISECONDS) : window.pollForInputEvents(event);
+        if (has_event) handleEvent(event, window, scene);
+        if (nothingToDraw()) continue;
+
+        if (drawn_version != g_view_version) {
+            g_refinement.restart();
+            drawn_version = g_view_version;
+        }
+//      a refinement pass that isn't finished yet draws nothing, so the frame the window already has stays up
+        if (refining()) {
+            if (refineScene(window, scene, g_refinement)) presentFrame(window);
+            continue;
+        }
+        drawScene(window, scene);
 
-        window.renderFrame();
+        presentFrame(window);
     }
 }
 